@@ -0,0 +1,117 @@
+#include "AtomStore.h"
+#include <string.h>
+
+void AtomStore::Init(const AtomArrays &atoms)
+{
+	size = atoms.GetSize();
+	chunks.Clear();
+	steps.Clear();
+	editing.changes.Clear();
+	applied = 0;
+
+	chunks.Resize((size + ChunkSize - 1) >> ChunkShift);
+	for (unsigned c = 0; c < chunks.GetSize(); c++)
+	{
+		chunks[c] = *NewChunk();
+		StoredAtom *dst = chunks[c]->atoms;
+		unsigned begin = c << ChunkShift;
+		unsigned count = size - begin < ChunkSize ? size - begin : ChunkSize;
+		for (unsigned j = 0; j < count; j++)
+		{
+			dst[j].x = atoms.x[begin + j];
+			dst[j].y = atoms.y[begin + j];
+			dst[j].z = atoms.z[begin + j];
+			dst[j].species = atoms.species[begin + j];
+			dst[j].removed = 0;
+		}
+	}
+}
+
+AtomStore::Chunk *AtomStore::NewChunk()
+{
+	// Slots past the size are removed atoms, so that Append() needs no copy.
+	Chunk *chunk = new Chunk;
+	memset(chunk->atoms, 0, sizeof(chunk->atoms));
+	for (unsigned j = 0; j < ChunkSize; j++)
+		chunk->atoms[j].removed = 1;
+	return chunk;
+}
+
+unsigned AtomStore::Append()
+{
+	if (size == chunks.GetSize() << ChunkShift)
+		chunks.PushBack(*NewChunk());
+	return size++;
+}
+
+void AtomStore::Set(unsigned i, const StoredAtom &atom)
+{
+	unsigned c = i >> ChunkShift;
+	bool copied = false;
+	for (unsigned k = 0; k < editing.changes.GetSize() && !copied; k++)
+		copied = editing.changes[k].chunk == c;
+	if (!copied)
+	{
+		// Earlier versions keep the old chunk, so this step gets its own copy.
+		Change change;
+		change.chunk = c;
+		change.before = chunks[c];
+		change.after = *new Chunk;
+		memcpy(change.after->atoms, change.before->atoms, sizeof(change.after->atoms));
+		chunks[c] = change.after;
+		editing.changes.PushBack(change);
+	}
+	chunks[c]->atoms[i & (ChunkSize - 1)] = atom;
+}
+
+void AtomStore::Commit()
+{
+	if (editing.changes.GetSize() == 0)
+		return;
+	steps.Resize(applied);
+	steps.PushBack(editing);
+	editing.changes.Clear();
+	if (steps.GetSize() > maxSteps)
+		steps.RemoveAt(0);
+	applied = (unsigned)steps.GetSize();
+}
+
+bool AtomStore::Undo(Array<uint32_t> &changed)
+{
+	Commit();
+	if (!CanUndo())
+		return false;
+	Swap(steps[--applied], true, changed);
+	return true;
+}
+
+bool AtomStore::Redo(Array<uint32_t> &changed)
+{
+	Commit();
+	if (!CanRedo())
+		return false;
+	Swap(steps[applied++], false, changed);
+	return true;
+}
+
+void AtomStore::Swap(const Step &step, bool undo, Array<uint32_t> &changed)
+{
+	for (unsigned k = 0; k < step.changes.GetSize(); k++)
+	{
+		const Change &change = step.changes[k];
+		chunks[change.chunk] = undo ? change.before : change.after;
+		const StoredAtom *a = change.before->atoms, *b = change.after->atoms;
+		for (unsigned j = 0; j < ChunkSize; j++)
+			if (!(a[j] == b[j]))
+				changed.PushBack((change.chunk << ChunkShift) + j);
+	}
+}
+
+size_t AtomStore::GetMemoryUsage() const
+{
+	// An upper bound: every change made one chunk, which may be current too.
+	size_t count = chunks.GetSize();
+	for (unsigned s = 0; s < steps.GetSize(); s++)
+		count += steps[s].changes.GetSize();
+	return count * sizeof(Chunk);
+}
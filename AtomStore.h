@@ -0,0 +1,87 @@
+#ifndef ATOMSTORE_H
+#define ATOMSTORE_H
+
+#include "Kernel/OVR_RefCount.h"
+#include "CrystalLattice.h"
+
+/// An atom that can be edited after generation.
+struct StoredAtom
+{
+	float x, y, z;
+	uint16_t species; ///< Index into the species palette of the renderer
+	uint16_t removed; ///< Nonzero if deleted; the index stays valid for bonds
+
+	Vector3f GetPos() const { return Vector3f(x, y, z); }
+	bool operator==(const StoredAtom &o) const
+	{
+		return x == o.x && y == o.y && z == o.z && species == o.species && removed == o.removed;
+	}
+};
+
+/// Editable atoms with undo and redo. Atoms live in fixed-size chunks that are
+/// never modified once an edit step has been committed: the first change to a
+/// chunk in a step copies it, and the step keeps the chunk pointers from
+/// before and after. Unchanged chunks are shared by every version, so a step
+/// costs memory and time in proportion to the chunks it touched, and undoing
+/// or redoing it only swaps those pointers back.
+class AtomStore
+{
+public:
+	enum { ChunkShift = 10, ChunkSize = 1 << ChunkShift };
+
+	AtomStore() : size(0), applied(0), maxSteps(256){}
+
+	/// Replaces the contents with atoms and forgets the history.
+	void Init(const AtomArrays &atoms);
+
+	unsigned GetSize() const { return size; }
+	const StoredAtom &Get(unsigned i) const { return chunks[i >> ChunkShift]->atoms[i & (ChunkSize - 1)]; }
+
+	/// Changes atom i as part of the step being edited.
+	void Set(unsigned i, const StoredAtom &atom);
+	/// Adds an atom that is removed in every version, and returns its index.
+	/// Set() it to add the atom as part of a step, so that undo removes it again.
+	unsigned Append();
+	/// Ends the step being edited, making it the one Undo() reverts, and
+	/// discards the steps that could have been redone.
+	void Commit();
+
+	bool CanUndo() const { return applied > 0; }
+	bool CanRedo() const { return applied < steps.GetSize(); }
+	/// Reverts the last committed step and appends the indices of the atoms it
+	/// changed to changed. Returns false if there is nothing to undo.
+	bool Undo(Array<uint32_t> &changed);
+	/// Reapplies the last undone step, like Undo().
+	bool Redo(Array<uint32_t> &changed);
+
+	/// Bytes held by the current chunks and the history.
+	size_t GetMemoryUsage() const;
+
+protected:
+	struct Chunk : public RefCountBase<Chunk>
+	{
+		StoredAtom atoms[ChunkSize];
+	};
+	struct Change
+	{
+		unsigned chunk;
+		Ptr<Chunk> before, after;
+	};
+	struct Step
+	{
+		Array<Change> changes;
+	};
+
+	void Swap(const Step &step, bool undo, Array<uint32_t> &changed);
+	/// Returns a chunk whose atoms are all removed.
+	static Chunk *NewChunk();
+
+	unsigned size;
+	Array<Ptr<Chunk> > chunks;
+	Array<Step> steps;     ///< Oldest first
+	unsigned applied;      ///< Steps at the front of steps that are in effect
+	unsigned maxSteps;     ///< Older steps are forgotten
+	Step editing;          ///< Chunks copied by the step not yet committed
+};
+
+#endif
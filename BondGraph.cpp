@@ -0,0 +1,215 @@
+#include "BondGraph.h"
+#include "WorkerPool.h"
+#include <algorithm>
+
+// Atoms encoded together by one task of Build(), whose bytes are collected
+// separately and then concatenated.
+static const unsigned slabAtoms = 4096;
+
+// Calls body over [0, count), on the shared WorkerPool if parallel.
+template<class F>
+static void Run(bool parallel, unsigned count, const F &body)
+{
+	if (parallel)
+		WorkerPool::Shared().ParallelFor(int(count), body);
+	else if (count)
+		body(0, int(count));
+}
+
+void SortBonds(unsigned atomCount, Array<BondPair> &bonds, bool parallel)
+{
+	const unsigned m = (unsigned)bonds.GetSize();
+	unsigned k = 0;
+	while (k < m && bonds[k].a < bonds[k].b && (k == 0 || bonds[k - 1].a < bonds[k].a
+		|| (bonds[k - 1].a == bonds[k].a && bonds[k - 1].b < bonds[k].b)))
+		k++;
+	if (k == m)
+		return;
+	Run(parallel, m, [&](int begin, int end){
+		for (int k = begin; k < end; k++)
+			if (bonds[k].b < bonds[k].a)
+				std::swap(bonds[k].a, bonds[k].b);
+	});
+
+	// Counting sort by the first atom, then each atom's few bonds by the second.
+	Array<uint32_t> rowStart, fill;
+	rowStart.Resize(atomCount + 1);
+	memset(&rowStart[0], 0, rowStart.GetSize() * sizeof(uint32_t));
+	for (unsigned k = 0; k < m; k++)
+		rowStart[bonds[k].a + 1]++;
+	for (unsigned i = 0; i < atomCount; i++)
+		rowStart[i + 1] += rowStart[i];
+	fill.Resize(atomCount);
+	memcpy(&fill[0], &rowStart[0], atomCount * sizeof(uint32_t));
+	Array<BondPair> sorted;
+	sorted.Resize(m);
+	for (unsigned k = 0; k < m; k++)
+		sorted[fill[bonds[k].a]++] = bonds[k];
+	Run(parallel, atomCount, [&](int begin, int end){
+		for (int i = begin; i < end; i++)
+			std::sort(&sorted[0] + rowStart[i], &sorted[0] + rowStart[i + 1],
+				[](const BondPair &x, const BondPair &y){ return x.b < y.b; });
+	});
+	memcpy(&bonds[0], &sorted[0], m * sizeof(BondPair));
+}
+
+void BondGraph::Encode(uint32_t v, Array<uint8_t> &out)
+{
+	while (0x80 <= v)
+	{
+		out.PushBack(uint8_t(v | 0x80));
+		v >>= 7;
+	}
+	out.PushBack(uint8_t(v));
+}
+
+void BondGraph::Build(unsigned atomCount, const Array<BondPair> &bonds, bool parallel)
+{
+	const unsigned n = atomCount, m = (unsigned)bonds.GetSize();
+	bondCount = m;
+	start.Resize(n + 1);
+	firstBond.Resize(n);
+	data.Clear();
+	if (n == 0)
+	{
+		start[0] = 0;
+		return;
+	}
+
+	// Bonds to higher neighbors are runs of bonds, and bonds to lower ones
+	// are gathered per atom, in increasing order as bonds are sorted.
+	Array<uint32_t> lowerStart, lower, fill;
+	lowerStart.Resize(n + 1);
+	memset(&lowerStart[0], 0, (n + 1) * sizeof(uint32_t));
+	memset(&firstBond[0], 0, n * sizeof(uint32_t));
+	for (unsigned k = 0; k < m; k++)
+	{
+		OVR_ASSERT(bonds[k].a < bonds[k].b && bonds[k].b < n);
+		OVR_ASSERT(k == 0 || bonds[k - 1].a < bonds[k].a || (bonds[k - 1].a == bonds[k].a && bonds[k - 1].b < bonds[k].b));
+		lowerStart[bonds[k].b + 1]++;
+		firstBond[bonds[k].a]++;
+	}
+	for (unsigned i = 0; i < n; i++)
+		lowerStart[i + 1] += lowerStart[i];
+	lower.Resize(m);
+	fill.Resize(n);
+	memcpy(&fill[0], &lowerStart[0], n * sizeof(uint32_t));
+	for (unsigned k = 0; k < m; k++)
+		lower[fill[bonds[k].b]++] = bonds[k].a;
+	for (unsigned i = 0, sum = 0; i < n; i++)
+	{
+		unsigned count = firstBond[i];
+		firstBond[i] = sum;
+		sum += count;
+	}
+
+	// Each slab of atoms is encoded on its own, then the slabs are
+	// concatenated in order into ranges sized from a prefix sum.
+	const unsigned slabCount = (n + slabAtoms - 1) / slabAtoms;
+	Array<Array<uint8_t> > slabs;
+	slabs.Resize(slabCount);
+	Run(parallel, slabCount, [&](int begin, int end){
+		for (int s = begin; s < end; s++)
+		{
+			Array<uint8_t> &out = slabs[s];
+			unsigned first = s * slabAtoms, last = first + slabAtoms < n ? first + slabAtoms : n;
+			for (unsigned i = first; i < last; i++)
+			{
+				start[i] = (uint32_t)out.GetSize();
+				bool head = true;
+				unsigned prev = i;
+				auto add = [&](unsigned j){
+					if (head)
+					{
+						int d = int(j) - int(i);
+						Encode(uint32_t(d) << 1 ^ uint32_t(d >> 31), out);
+						head = false;
+					}
+					else
+						Encode(j - prev - 1, out);
+					prev = j;
+				};
+				for (uint32_t k = lowerStart[i]; k < lowerStart[i + 1]; k++)
+					add(lower[k]);
+				for (uint32_t k = firstBond[i]; k < m && bonds[k].a == i; k++)
+					add(bonds[k].b);
+			}
+		}
+	});
+
+	Array<uint32_t> slabStart;
+	slabStart.Resize(slabCount + 1);
+	slabStart[0] = 0;
+	for (unsigned s = 0; s < slabCount; s++)
+	{
+		OVR_ASSERT(uint64_t(slabStart[s]) + slabs[s].GetSize() <= 0xffffffffu);
+		slabStart[s + 1] = slabStart[s] + (uint32_t)slabs[s].GetSize();
+	}
+	data.Resize(slabStart[slabCount]);
+	start[n] = slabStart[slabCount];
+	Run(parallel, slabCount, [&](int begin, int end){
+		for (int s = begin; s < end; s++)
+		{
+			unsigned first = s * slabAtoms, last = first + slabAtoms < n ? first + slabAtoms : n;
+			for (unsigned i = first; i < last; i++)
+				start[i] += slabStart[s];
+			if (slabs[s].GetSize())
+				memcpy(&data[slabStart[s]], &slabs[s][0], slabs[s].GetSize());
+		}
+	});
+}
+
+void BondGraph::Clear()
+{
+	start.ClearAndRelease();
+	firstBond.ClearAndRelease();
+	data.ClearAndRelease();
+	bondCount = 0;
+}
+
+unsigned BondGraph::GetDegree(unsigned i) const
+{
+	// Every number ends in a byte without the continuation bit.
+	unsigned degree = 0;
+	for (uint32_t k = start[i]; k < start[i + 1]; k++)
+		degree += data[k] < 0x80;
+	return degree;
+}
+
+unsigned BondGraph::GetNeighbor(unsigned i, unsigned k) const
+{
+	OVR_ASSERT(k < GetDegree(i));
+	const uint8_t *p = &data[start[i]];
+	uint32_t first = Decode(p);
+	unsigned j = unsigned(int(i) + int(first >> 1 ^ (0 - (first & 1))));
+	while (k--)
+		j += Decode(p) + 1;
+	return j;
+}
+
+uint32_t BondGraph::FindBond(unsigned i, unsigned j) const
+{
+	if (j < i)
+		std::swap(i, j);
+	if (j == i || GetAtomCount() <= j || start[i] == start[i + 1])
+		return ~0u;
+	// j is among the higher neighbors of i, whose bonds are numbered in order.
+	const uint8_t *p = &data[start[i]], *end = p + (start[i + 1] - start[i]);
+	uint32_t first = Decode(p);
+	unsigned k = unsigned(int(i) + int(first >> 1 ^ (0 - (first & 1))));
+	uint32_t bond = firstBond[i];
+	for (;;)
+	{
+		if (k == j)
+			return bond;
+		if (j < k || p == end)
+			return ~0u;
+		bond += i < k;
+		k += Decode(p) + 1;
+	}
+}
+
+size_t BondGraph::GetMemoryUsage() const
+{
+	return (start.GetSize() + firstBond.GetSize()) * sizeof(uint32_t) + data.GetSize();
+}
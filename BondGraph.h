@@ -0,0 +1,85 @@
+#ifndef BONDGRAPH_H
+#define BONDGRAPH_H
+
+#include "CrystalLattice.h"
+
+/// Sorts bonds by their first atom, then their second, after swapping the
+/// ends of any bond whose first atom is the higher. This is the bond order of
+/// BondGraph. atomCount bounds the atom indices. Bonds already in order are
+/// only checked.
+void SortBonds(unsigned atomCount, Array<BondPair> &bonds, bool parallel = true);
+
+/// The bonds of atomCount atoms as a compressed sparse row adjacency list:
+/// the neighbors of each atom, in increasing order, are stored as the
+/// differences between consecutive ones in a variable number of bytes, 7 bits
+/// to a byte. The first is relative to the atom itself. In the order
+/// GenerateLattice() makes, bonded atoms are at most a few rows of cells
+/// apart, so most neighbors take one or two bytes instead of four and a
+/// crystal of 10^7 atoms and 4 * 10^7 bonds fits in about 210 MB.
+///
+/// Bonds are numbered as in an array in bond order (see SortBonds()), so the
+/// graph can stand in for an index from atoms to their bonds.
+class BondGraph
+{
+public:
+	BondGraph() : bondCount(0){}
+
+	/// Builds the graph of bonds, which must be in bond order. The shared
+	/// WorkerPool is used unless parallel is false.
+	void Build(unsigned atomCount, const Array<BondPair> &bonds, bool parallel = true);
+	void Clear();
+
+	unsigned GetAtomCount() const { return start.GetSize() ? (unsigned)start.GetSize() - 1 : 0; }
+	unsigned GetBondCount() const { return bondCount; }
+	unsigned GetDegree(unsigned i) const;
+	/// Returns neighbor k of atom i in increasing order, which must exist.
+	unsigned GetNeighbor(unsigned i, unsigned k) const;
+	/// Returns the number of the bond between atoms i and j, or ~0u if there is none.
+	uint32_t FindBond(unsigned i, unsigned j) const;
+
+	/// Calls f(j) with each neighbor j of atom i in increasing order.
+	template<class F> void ForEachNeighbor(unsigned i, F f) const
+	{
+		if (start[i] == start[i + 1])
+			return;
+		const uint8_t *p = &data[start[i]], *end = p + (start[i + 1] - start[i]);
+		uint32_t first = Decode(p);
+		unsigned j = unsigned(int(i) + int(first >> 1 ^ (0 - (first & 1))));
+		f(j);
+		while (p < end)
+		{
+			j += Decode(p) + 1;
+			f(j);
+		}
+	}
+
+	/// Calls f(j, bond) with each neighbor j of atom i in increasing order and
+	/// the number of their bond.
+	template<class F> void ForEachBond(unsigned i, F f) const
+	{
+		uint32_t upper = firstBond[i];
+		ForEachNeighbor(i, [&](unsigned j){
+			f(j, j < i ? FindBond(j, i) : upper++);
+		});
+	}
+
+	size_t GetMemoryUsage() const;
+
+protected:
+	/// Reads one variable length number at p and advances p past it.
+	static uint32_t Decode(const uint8_t *&p)
+	{
+		uint32_t v = *p & 0x7f;
+		for (int shift = 7; *p++ & 0x80; shift += 7)
+			v |= uint32_t(*p & 0x7f) << shift;
+		return v;
+	}
+	static void Encode(uint32_t v, Array<uint8_t> &out);
+
+	Array<uint32_t> start;     ///< Offset of the neighbors of each atom in data; one extra at the end
+	Array<uint32_t> firstBond; ///< Number of the first bond to a higher neighbor of each atom
+	Array<uint8_t> data;
+	unsigned bondCount;
+};
+
+#endif
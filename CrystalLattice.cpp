@@ -0,0 +1,225 @@
+#include "CrystalLattice.h"
+#include "SpaceGroup.h"
+#include "WorkerPool.h"
+#include <mutex>
+
+static const BasisAtom singleBasis[] = {
+	{0, 0, 0, 0},
+};
+
+// The hexagonal axis points up (+Y) in this one.
+static const BasisAtom hcpBasis[] = {
+	{0, 0, 0, 0}, {1.f / 3.f, 0.5f, 2.f / 3.f, 0},
+};
+
+#define BASIS(a) a, sizeof(a) / sizeof(a[0])
+
+static const float sqrt2 = 1.41421356f;
+static const float sqrt3 = 1.73205081f;
+
+// Those without a basis here get one from ExpandBases().
+static LatticeDesc lattices[Num_CrystalStructure] = {
+	{"Simple Cubic", Vector3f(1, 0, 0), Vector3f(0, 1, 0), Vector3f(0, 0, 1), BASIS(singleBasis), 3},
+	{"Face Centered Cubic", Vector3f(sqrt2, 0, 0), Vector3f(0, sqrt2, 0), Vector3f(0, 0, sqrt2), NULL, 0, 2},
+	{"Body Centered Cubic", Vector3f(2 / sqrt3, 0, 0), Vector3f(0, 2 / sqrt3, 0), Vector3f(0, 0, 2 / sqrt3), NULL, 0, 3},
+	{"Diamond", Vector3f(4 / sqrt3, 0, 0), Vector3f(0, 4 / sqrt3, 0), Vector3f(0, 0, 4 / sqrt3), NULL, 0, 2},
+	{"Hexagonal Close Packed", Vector3f(1, 0, 0), Vector3f(0, 2 * sqrt2 / sqrt3, 0), Vector3f(-0.5f, 0, sqrt3 / 2), BASIS(hcpBasis), 3},
+	{"Rock Salt", Vector3f(2, 0, 0), Vector3f(0, 2, 0), Vector3f(0, 0, 2), NULL, 0, 2},
+	{"Perovskite", Vector3f(2, 0, 0), Vector3f(0, 2, 0), Vector3f(0, 0, 2), NULL, 0, 3},
+	// a = 4.594 and c = 2.959 angstroms over the shortest Ti-O bond of 1.949.
+	{"Rutile", Vector3f(2.3575f, 0, 0), Vector3f(0, 2.3575f, 0), Vector3f(0, 0, 1.5185f), NULL, 0, 3},
+};
+
+static const BasisAtom originSite[] = {
+	{0, 0, 0, 0},
+};
+
+// Na, then Cl.
+static const BasisAtom rockSaltSites[] = {
+	{0, 0, 0, 0}, {0.5f, 0.5f, 0.5f, 1},
+};
+
+// Ca, Ti, then O.
+static const BasisAtom perovskiteSites[] = {
+	{0, 0, 0, 0}, {0.5f, 0.5f, 0.5f, 2}, {0.5f, 0.5f, 0, 1},
+};
+
+// Ti, then O.
+static const BasisAtom rutileSites[] = {
+	{0, 0, 0, 2}, {0.3048f, 0.3048f, 0, 1},
+};
+
+// P4_2/mnm, as listed in the International Tables.
+static const char *const rutileOps[] = {
+	"x,y,z", "-x,-y,z", "-y+1/2,x+1/2,z+1/2", "y+1/2,-x+1/2,z+1/2",
+	"-x+1/2,y+1/2,-z+1/2", "x+1/2,-y+1/2,-z+1/2", "y,x,-z", "-y,-x,-z",
+	"-x,-y,-z", "x,y,-z", "y+1/2,-x+1/2,-z+1/2", "-y+1/2,x+1/2,-z+1/2",
+	"x+1/2,-y+1/2,z+1/2", "-x+1/2,y+1/2,z+1/2", "-y,-x,z", "y,x,z",
+};
+
+/// A structure whose basis is the orbit of an asymmetric unit under its space
+/// group, which is either listed operation by operation or, if ops is NULL,
+/// made by MakeCubicSpaceGroup().
+struct SpaceGroupBasis
+{
+	CrystalStructure structure;
+	LatticeCentering centering;
+	float inversionShift; ///< See MakeCubicSpaceGroup()
+	const char *const *ops; ///< In the form ParseSymOp() reads
+	int opCount;
+	const BasisAtom *sites;
+	int siteCount;
+};
+
+static const SpaceGroupBasis spaceGroupBases[] = {
+	{FCC, Centering_F, 0, NULL, 0, BASIS(originSite)}, // Fm-3m
+	{BCC, Centering_I, 0, NULL, 0, BASIS(originSite)}, // Im-3m
+	{Diamond, Centering_F, 0.25f, NULL, 0, BASIS(originSite)}, // Fd-3m
+	{RockSalt, Centering_F, 0, NULL, 0, BASIS(rockSaltSites)}, // Fm-3m
+	{Perovskite, Centering_P, 0, NULL, 0, BASIS(perovskiteSites)}, // Pm-3m
+	{Rutile, Centering_P, 0, BASIS(rutileOps), BASIS(rutileSites)}, // P4_2/mnm
+};
+static const int numSpaceGroupBases = sizeof(spaceGroupBases) / sizeof(spaceGroupBases[0]);
+
+// The basis of each of spaceGroupBases, however many atoms it has. Made on
+// first use and never freed, because a static Array could outlive the
+// allocator at exit.
+static Array<BasisAtom> *expandedBases;
+static std::once_flag expandOnce;
+
+static void ExpandBases()
+{
+	Array<SymOp> ops;
+	expandedBases = new Array<BasisAtom>[numSpaceGroupBases];
+	for (int i = 0; i < numSpaceGroupBases; i++)
+	{
+		const SpaceGroupBasis &g = spaceGroupBases[i];
+		ops.Clear();
+		if (g.ops)
+		{
+			for (int k = 0; k < g.opCount; k++)
+			{
+				SymOp op;
+				bool parsed = ParseSymOp(g.ops[k], op);
+				OVR_ASSERT(parsed);
+				OVR_UNUSED(parsed);
+				ops.PushBack(op);
+			}
+		}
+		else
+			MakeCubicSpaceGroup(g.centering, g.inversionShift, ops);
+		Array<BasisAtom> &basis = expandedBases[i];
+		ExpandAsymmetricUnit(&ops[0], (int)ops.GetSize(), g.sites, g.siteCount, 1e-3f, basis);
+		lattices[g.structure].basis = &basis[0];
+		lattices[g.structure].basisCount = (int)basis.GetSize();
+	}
+}
+
+const LatticeDesc &GetLatticeDesc(CrystalStructure structure)
+{
+	std::call_once(expandOnce, ExpandBases);
+	return lattices[structure < Num_CrystalStructure ? structure : Cube];
+}
+
+void GenerateLattice(const LatticeDesc &desc, int cells, AtomArrays &atoms)
+{
+	GenerateLatticeRange(desc, -cells, -cells, -cells, 2 * cells, 2 * cells, 2 * cells, atoms);
+}
+
+void GenerateLatticeRange(const LatticeDesc &desc, int x0, int y0, int z0, int nx, int ny, int nz, AtomArrays &atoms)
+{
+	atoms.Resize(unsigned(nx) * ny * nz * desc.basisCount);
+	if (atoms.GetSize() == 0)
+		return;
+	float *x = &atoms.x[0], *y = &atoms.y[0], *z = &atoms.z[0];
+	uint16_t *species = &atoms.species[0];
+	const Vector3f a = desc.a;
+
+	// Every (iz, iy) row of cells owns a fixed range of the output, so rows can
+	// be filled by any thread in any order and the result is always the same.
+	WorkerPool::Shared().ParallelFor(ny * nz, [&](int rowBegin, int rowEnd){
+		for (int r = rowBegin; r < rowEnd; r++)
+		{
+			int iz = r / ny + z0, iy = r % ny + y0;
+			unsigned k = unsigned(r) * desc.basisCount * nx;
+			for (int b = 0; b < desc.basisCount; b++)
+			{
+				const BasisAtom &ba = desc.basis[b];
+				Vector3f row = desc.ToCartesian(ba.x + x0, ba.y + iy, ba.z + iz);
+
+				// A contiguous affine run along the first lattice vector,
+				// which the compiler turns into vector instructions.
+				float *px = x + k, *py = y + k, *pz = z + k;
+				uint16_t *ps = species + k;
+				for (int i = 0; i < nx; i++)
+				{
+					px[i] = row.x + i * a.x;
+					py[i] = row.y + i * a.y;
+					pz[i] = row.z + i * a.z;
+					ps[i] = ba.species;
+				}
+				k += nx;
+			}
+		}
+	});
+}
+
+void GenerateLatticeShell(const LatticeDesc &desc, int inner, int outer, AtomArrays &atoms)
+{
+	// The two caps along z, then the two walls along y between them, then the
+	// two walls along x that close the remaining ring.
+	const int w = outer - inner, n = 2 * outer, m = 2 * inner;
+	const struct { int x0, y0, z0, nx, ny, nz; } boxes[] = {
+		{-outer, -outer, -outer, n, n, w}, {-outer, -outer, inner, n, n, w},
+		{-outer, -outer, -inner, n, w, m}, {-outer, inner, -inner, n, w, m},
+		{-outer, -inner, -inner, w, m, m}, {inner, -inner, -inner, w, m, m},
+	};
+	atoms.Resize(0);
+	AtomArrays box;
+	for (int i = 0; i < int(sizeof(boxes) / sizeof(boxes[0])); i++)
+	{
+		GenerateLatticeRange(desc, boxes[i].x0, boxes[i].y0, boxes[i].z0, boxes[i].nx, boxes[i].ny, boxes[i].nz, box);
+		unsigned base = atoms.GetSize(), count = box.GetSize();
+		atoms.Resize(base + count);
+		atoms.Copy(base, box, 0, count);
+	}
+}
+
+float NearestNeighborDistance(const LatticeDesc &desc)
+{
+	// The nearest image of every basis atom is in one of the adjacent cells.
+	float nearest = 1e10f;
+	for (int i = 0; i < desc.basisCount; i++)
+		for (int j = 0; j < desc.basisCount; j++)
+			for (int dz = -1; dz <= 1; dz++)
+				for (int dy = -1; dy <= 1; dy++)
+					for (int dx = -1; dx <= 1; dx++)
+					{
+						if (i == j && dx == 0 && dy == 0 && dz == 0)
+							continue;
+						const BasisAtom &bi = desc.basis[i], &bj = desc.basis[j];
+						float d = desc.ToCartesian(bj.x + dx - bi.x, bj.y + dy - bi.y, bj.z + dz - bi.z).Length();
+						if (d < nearest)
+							nearest = d;
+					}
+	return nearest;
+}
+
+int CountBondsPerCell(const LatticeDesc &desc, float cutoff)
+{
+	// Every bond is counted from both of its atoms.
+	int ends = 0;
+	for (int i = 0; i < desc.basisCount; i++)
+		for (int j = 0; j < desc.basisCount; j++)
+			for (int dz = -1; dz <= 1; dz++)
+				for (int dy = -1; dy <= 1; dy++)
+					for (int dx = -1; dx <= 1; dx++)
+					{
+						if (i == j && dx == 0 && dy == 0 && dz == 0)
+							continue;
+						const BasisAtom &bi = desc.basis[i], &bj = desc.basis[j];
+						if (desc.ToCartesian(bj.x + dx - bi.x, bj.y + dy - bi.y, bj.z + dz - bi.z).Length() < cutoff)
+							ends++;
+					}
+	return ends / 2;
+}
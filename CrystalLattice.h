@@ -0,0 +1,131 @@
+#ifndef CRYSTALLATTICE_H
+#define CRYSTALLATTICE_H
+
+#include "Kernel/OVR_Math.h"
+#include "Kernel/OVR_Array.h"
+
+using namespace OVR;
+
+enum CrystalStructure
+{
+	Cube,
+	FCC, // Face Centered Cubic
+	BCC, // Body Centered Cubic
+	Diamond,
+	HCP, // Hexagonal Close Packed
+	RockSalt, // NaCl
+	Perovskite, // CaTiO3
+	Rutile, // TiO2
+	Num_CrystalStructure
+};
+
+/// An atom of the basis in fractional coordinates of the unit cell.
+struct BasisAtom
+{
+	float x, y, z;
+	uint16_t species; ///< Index into the species palette of the renderer
+};
+
+/// A unit cell given by three lattice vectors, which need not be orthogonal,
+/// and the atoms it contains. All built-in cells are scaled so that the nearest
+/// neighbor distance is 1.
+struct LatticeDesc
+{
+	const char *name;
+	Vector3f a, b, c;
+	const BasisAtom *basis;
+	int basisCount;
+	int cells; ///< Default half extent of the crystal in unit cells
+
+	/// Converts fractional coordinates to Cartesian.
+	Vector3f ToCartesian(float fx, float fy, float fz) const
+	{
+		return a * fx + b * fy + c * fz;
+	}
+
+	/// Converts Cartesian coordinates to fractional ones, the inverse of ToCartesian().
+	Vector3f ToFractional(const Vector3f &p) const
+	{
+		float volume = a.Dot(b.Cross(c));
+		return Vector3f(p.Dot(b.Cross(c)), p.Dot(c.Cross(a)), p.Dot(a.Cross(b))) / volume;
+	}
+};
+
+/// Returns the unit cell of a built-in structure.
+const LatticeDesc &GetLatticeDesc(CrystalStructure structure);
+
+/// Atom positions and species in structure-of-arrays form.
+struct AtomArrays
+{
+	Array<float> x, y, z;
+	Array<uint16_t> species;
+
+	unsigned GetSize() const { return (unsigned)x.GetSize(); }
+	void Resize(unsigned n){ x.Resize(n); y.Resize(n); z.Resize(n); species.Resize(n); }
+	Vector3f GetPos(unsigned i) const { return Vector3f(x[i], y[i], z[i]); }
+	/// Copies count atoms starting at from[first] to this starting at at.
+	void Copy(unsigned at, const AtomArrays &from, unsigned first, unsigned count)
+	{
+		if (count == 0)
+			return;
+		memcpy(&x[at], &from.x[first], count * sizeof(float));
+		memcpy(&y[at], &from.y[first], count * sizeof(float));
+		memcpy(&z[at], &from.z[first], count * sizeof(float));
+		memcpy(&species[at], &from.species[first], count * sizeof(uint16_t));
+	}
+	/// Copies atom j of from to atom i.
+	void Set(unsigned i, const AtomArrays &from, unsigned j)
+	{
+		x[i] = from.x[j];
+		y[i] = from.y[j];
+		z[i] = from.z[j];
+		species[i] = from.species[j];
+	}
+};
+
+/// Bond between two atoms, given by their indices.
+struct BondPair
+{
+	uint32_t a, b;
+};
+
+/// Fills atoms with every atom in the cells [-cells, cells) along each lattice
+/// vector. Atoms are ordered by cell row (z, then y), then basis atom, then
+/// position along the first lattice vector, so each run of 2 * cells atoms is
+/// a straight affine sequence.
+void GenerateLattice(const LatticeDesc &desc, int cells, AtomArrays &atoms);
+
+/// Like GenerateLattice(), but for the box of cells starting at cell (x0, y0, z0)
+/// that is nx by ny by nz cells large.
+void GenerateLatticeRange(const LatticeDesc &desc, int x0, int y0, int z0, int nx, int ny, int nz, AtomArrays &atoms);
+
+/// Fills atoms with the atoms GenerateLattice() makes for outer cells but not
+/// for inner cells, i.e. the hollow box of shells inner to outer - 1.
+void GenerateLatticeShell(const LatticeDesc &desc, int inner, int outer, AtomArrays &atoms);
+
+/// Returns the shell of cell (ix, iy, iz), which is the smallest number of
+/// cells for which GenerateLattice() includes it, minus one.
+inline int LatticeShell(int ix, int iy, int iz)
+{
+	int sx = ix < 0 ? -1 - ix : ix, sy = iy < 0 ? -1 - iy : iy, sz = iz < 0 ? -1 - iz : iz;
+	int s = sx < sy ? sy : sx;
+	return s < sz ? sz : s;
+}
+
+/// Returns the index GenerateLattice() gives to basis atom b of cell (ix, iy, iz).
+inline uint32_t LatticeIndex(const LatticeDesc &desc, int cells, int ix, int iy, int iz, int b)
+{
+	int n = 2 * cells;
+	return uint32_t((((iz + cells) * n + (iy + cells)) * desc.basisCount + b) * n + (ix + cells));
+}
+
+/// Returns the shortest distance between two atoms of the infinite lattice.
+float NearestNeighborDistance(const LatticeDesc &desc);
+
+/// Returns the number of bonds per unit cell of the infinite lattice between
+/// atoms closer than cutoff. Like NearestNeighborDistance(), only the adjacent
+/// cells are searched, which is enough for cutoffs near the nearest neighbor
+/// distance.
+int CountBondsPerCell(const LatticeDesc &desc, float cutoff);
+
+#endif
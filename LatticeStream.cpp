@@ -0,0 +1,187 @@
+#include "LatticeStream.h"
+#include "NeighborGrid.h"
+#include <algorithm>
+
+LatticeStream::LatticeStream(const LatticeDesc &desc, float bondCutoff, Container &atomParent, Container &bondParent,
+	const NodeMaker &maker, int chunkCells, int radius)
+	: desc(desc), bondCutoff(bondCutoff), atomParent(atomParent), bondParent(bondParent), maker(maker),
+	chunkCells(chunkCells), radius(radius), vx(0), vy(0), vz(0), queued(false), quit(false)
+{
+	thread = std::thread(&LatticeStream::StreamThread, this);
+}
+
+LatticeStream::~LatticeStream()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_one();
+	thread.join();
+}
+
+int LatticeStream::Distance(const Chunk &c) const
+{
+	int dx = abs(c.x - vx), dy = abs(c.y - vy), dz = abs(c.z - vz);
+	return dx < dy ? (dy < dz ? dz : dy) : (dx < dz ? dz : dx);
+}
+
+bool LatticeStream::Contains(const Array<Chunk> &chunks, int x, int y, int z)
+{
+	for (unsigned i = 0; i < chunks.GetSize(); i++)
+		if (chunks[i].x == x && chunks[i].y == y && chunks[i].z == z)
+			return true;
+	return false;
+}
+
+bool LatticeStream::Update(const Vector3f &viewPos)
+{
+	Vector3f f = desc.ToFractional(viewPos) / float(chunkCells);
+	int x = (int)floor(f.x), y = (int)floor(f.y), z = (int)floor(f.z);
+	if (x != vx || y != vy || z != vz)
+	{
+		vx = x;
+		vy = y;
+		vz = z;
+		queued = false;
+	}
+
+	Array<Chunk> finished;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finished = done;
+		done.Clear();
+	}
+
+	// Adopt finished chunks unless the viewer has left them behind meanwhile.
+	bool added = false;
+	for (unsigned i = 0; i < finished.GetSize(); i++)
+	{
+		Chunk &c = finished[i];
+		if (radius + 1 < Distance(c) || Contains(resident, c.x, c.y, c.z))
+			continue;
+		if (c.atoms)
+			atomParent.Add(c.atoms);
+		if (c.bonds)
+			bondParent.Add(c.bonds);
+		resident.PushBack(c);
+		added = true;
+	}
+
+	// The extra chunk of margin keeps chunks from thrashing at a border.
+	for (unsigned i = (unsigned)resident.GetSize(); i-- > 0;)
+	{
+		if (Distance(resident[i]) <= radius + 1)
+			continue;
+		if (resident[i].atoms)
+			atomParent.Remove(resident[i].atoms);
+		if (resident[i].bonds)
+			bondParent.Remove(resident[i].bonds);
+		resident.RemoveAt(i);
+	}
+
+	if (!queued)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.Clear();
+		for (int dz = -radius; dz <= radius; dz++)
+			for (int dy = -radius; dy <= radius; dy++)
+				for (int dx = -radius; dx <= radius; dx++)
+				{
+					int cx = vx + dx, cy = vy + dy, cz = vz + dz;
+					if (Contains(resident, cx, cy, cz) || Contains(busy, cx, cy, cz) || Contains(done, cx, cy, cz))
+						continue;
+					Chunk c;
+					c.x = cx;
+					c.y = cy;
+					c.z = cz;
+					queue.PushBack(c);
+				}
+
+		// Nearest at the back, where the stream thread takes from.
+		if (queue.GetSize())
+			std::sort(&queue[0], &queue[0] + queue.GetSize(), [&](const Chunk &a, const Chunk &b){
+				int da = (a.x - vx) * (a.x - vx) + (a.y - vy) * (a.y - vy) + (a.z - vz) * (a.z - vz);
+				int db = (b.x - vx) * (b.x - vx) + (b.y - vy) * (b.y - vy) + (b.z - vz) * (b.z - vz);
+				return da > db;
+			});
+		queued = true;
+		wake.notify_one();
+	}
+
+	return added;
+}
+
+void LatticeStream::StreamThread()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		wake.wait(lock, [&]{ return quit || queue.GetSize(); });
+		if (quit)
+			break;
+		Chunk c = queue.Back();
+		queue.Pop();
+		busy.PushBack(c);
+		lock.unlock();
+
+		Generate(c);
+
+		lock.lock();
+		busy.Clear();
+		done.PushBack(c);
+	}
+}
+
+void LatticeStream::Generate(Chunk &chunk) const
+{
+	// The chunk's cells with a halo one cell thick, so that bonds leaving the
+	// chunk are found too.
+	const int k = chunkCells, n = chunkCells + 2, basis = desc.basisCount;
+	AtomArrays halo;
+	GenerateLatticeRange(desc, chunk.x * k - 1, chunk.y * k - 1, chunk.z * k - 1, n, n, n, halo);
+	Array<BondPair> haloBonds;
+	FindBonds(halo, bondCutoff, haloBonds);
+
+	// Halo indices follow (z, y, basis, x) order, and so does the whole lattice
+	// however it is chunked. A bond thus belongs to the chunk of its endpoint
+	// with the lower index, which FindBonds() puts first.
+	auto isCore = [&](uint32_t i){
+		int x = i % n;
+		i /= n * basis;
+		int y = i % n, z = i / n;
+		return 0 < x && x <= k && 0 < y && y <= k && 0 < z && z <= k;
+	};
+
+	// Own atoms first, then the foreign endpoints of owned bonds.
+	Array<uint32_t> remap;
+	remap.Resize(halo.GetSize());
+	unsigned count = 0;
+	for (uint32_t i = 0; i < halo.GetSize(); i++)
+		remap[i] = isCore(i) ? count++ : ~0u;
+	unsigned coreCount = count;
+
+	Array<BondPair> bonds;
+	for (unsigned i = 0; i < haloBonds.GetSize(); i++)
+	{
+		BondPair p = haloBonds[i];
+		if (!isCore(p.a))
+			continue;
+		if (remap[p.b] == ~0u)
+			remap[p.b] = count++;
+		p.a = remap[p.a];
+		p.b = remap[p.b];
+		bonds.PushBack(p);
+	}
+
+	AtomArrays atoms;
+	atoms.Resize(count);
+	for (uint32_t i = 0; i < halo.GetSize(); i++)
+	{
+		if (remap[i] == ~0u)
+			continue;
+		atoms.Set(remap[i], halo, i);
+	}
+
+	maker(atoms, coreCount, bonds, chunk.atoms, chunk.bonds);
+}
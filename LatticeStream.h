@@ -0,0 +1,65 @@
+#ifndef LATTICESTREAM_H
+#define LATTICESTREAM_H
+
+#include "RenderTiny_D3D11_Device.h"
+#include "CrystalLattice.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/// Keeps the part of an unbounded lattice around the viewer resident. Space is
+/// divided into chunks of chunkCells^3 unit cells. Chunks up to radius chunks
+/// from the viewer's are generated on a thread of their own, nearest first,
+/// and chunks more than radius + 1 away are evicted, so memory stays constant
+/// however far the viewer walks.
+class LatticeStream{
+public:
+	/// Makes the scene nodes of a chunk on the stream thread. atoms holds the
+	/// chunk's own atoms first, followed by the atoms of neighboring chunks that
+	/// its bonds reach. Bonds crossing a chunk border belong to exactly one chunk.
+	typedef std::function<void(const AtomArrays &atoms, unsigned coreCount, const Array<BondPair> &bonds,
+		Ptr<Node> &atomNode, Ptr<Node> &bondNode)> NodeMaker;
+
+	LatticeStream(const LatticeDesc &desc, float bondCutoff, Container &atomParent, Container &bondParent,
+		const NodeMaker &maker, int chunkCells = 4, int radius = 2);
+	~LatticeStream();
+
+	/// Adds finished chunks to the parent containers, evicts distant ones and
+	/// queues missing ones around viewPos. Call on the render thread once per
+	/// frame; returns true if any chunk was added.
+	bool Update(const Vector3f &viewPos);
+
+	unsigned GetResidentCount() const { return (unsigned)resident.GetSize(); }
+
+protected:
+	struct Chunk{
+		int x, y, z;
+		Ptr<Node> atoms, bonds;
+	};
+
+	void StreamThread();
+	void Generate(Chunk &chunk) const;
+	/// Chebyshev distance in chunks from the viewer's chunk.
+	int Distance(const Chunk &c) const;
+	static bool Contains(const Array<Chunk> &chunks, int x, int y, int z);
+
+	const LatticeDesc &desc;
+	float bondCutoff;
+	Container &atomParent, &bondParent;
+	NodeMaker maker;
+	int chunkCells, radius;
+	int vx, vy, vz; ///< Chunk the viewer is in
+	bool queued; ///< Whether the queue matches vx, vy, vz
+	Array<Chunk> resident; ///< Chunks in the parent containers
+
+	std::thread thread;
+	std::mutex mutex; ///< Guards the members below
+	std::condition_variable wake;
+	Array<Chunk> queue; ///< Chunks to generate, nearest at the back
+	Array<Chunk> busy;  ///< Chunk being generated, if any
+	Array<Chunk> done;  ///< Generated chunks waiting for Update()
+	bool quit;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#include "MeshCache.h"
+
+Ptr<Model> MeshCache::Get(MeshShape shape, int slices, int stacks, float radius)
+{
+	if (shape == Mesh_Cylinder)
+		stacks = 1;
+	else if (shape == Mesh_Line)
+	{
+		slices = stacks = 0;
+		radius = 0;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (unsigned i = 0; i < entries.GetSize(); i++)
+	{
+		const Entry &e = entries[i];
+		if (e.shape == shape && e.slices == slices && e.stacks == stacks && e.radius == radius)
+			return e.mesh;
+	}
+
+	Entry e;
+	e.shape = shape;
+	e.slices = slices;
+	e.stacks = stacks;
+	e.radius = radius;
+	e.mesh = *new Model(shape == Mesh_Line ? Prim_Lines : Prim_Triangles);
+	if (shape == Mesh_Sphere)
+		e.mesh->AddSphere(radius, slices, stacks);
+	else if (shape == Mesh_Cylinder)
+		e.mesh->AddCylinder(radius, 1.f, slices);
+	else
+	{
+		// Lit as if seen from the side.
+		Vector3f normal(1, 0, 0);
+		e.mesh->AddLine(e.mesh->AddVertex(Vertex(Vector3f(0, 0, -1), Color(127, 0, 127, 255), 0, -1, normal)),
+			e.mesh->AddVertex(Vertex(Vector3f(0, 0, 1), Color(127, 0, 127, 255), 0, 1, normal)));
+	}
+	entries.PushBack(e);
+	return e.mesh;
+}
+
+void MeshCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.Clear();
+}
@@ -0,0 +1,34 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include "RenderTiny_D3D11_Device.h"
+#include <mutex>
+
+enum MeshShape{
+	Mesh_Sphere,
+	Mesh_Cylinder, ///< slices are the segments around the axis; stacks are ignored
+	Mesh_Line, ///< The axis of Mesh_Cylinder as a line list; slices, stacks and radius are ignored
+};
+
+/// Tessellated meshes shared by everything that draws the same shape. Each
+/// distinct shape, tessellation and radius is built once, and since users
+/// share the Model they also share its vertex and index buffers.
+/// Safe to call from the build thread and the render thread alike.
+class MeshCache{
+public:
+	/// Returns the mesh, tessellating it on first request.
+	Ptr<Model> Get(MeshShape shape, int slices, int stacks, float radius = 1.f);
+	void Clear();
+
+protected:
+	struct Entry{
+		MeshShape shape;
+		int slices, stacks;
+		float radius;
+		Ptr<Model> mesh;
+	};
+	std::mutex mutex;
+	Array<Entry> entries; ///< Only a handful, so searched linearly
+};
+
+#endif
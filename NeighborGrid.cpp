@@ -0,0 +1,286 @@
+#include "NeighborGrid.h"
+#include "WorkerPool.h"
+
+// Neighboring cells that come after a cell in (z, y, x) order. Visiting only
+// these, plus the later points of the cell itself, sees every pair once.
+static const int halfStencil[13][3] = {
+	{1, 0, 0},
+	{-1, 1, 0}, {0, 1, 0}, {1, 1, 0},
+	{-1, -1, 1}, {0, -1, 1}, {1, -1, 1},
+	{-1, 0, 1}, {0, 0, 1}, {1, 0, 1},
+	{-1, 1, 1}, {0, 1, 1}, {1, 1, 1},
+};
+
+void NeighborGrid::CellOf(float px, float py, float pz, int &cx, int &cy, int &cz) const
+{
+	cx = int((px - origin.x) / cellSize);
+	cy = int((py - origin.y) / cellSize);
+	cz = int((pz - origin.z) / cellSize);
+	cx = cx < 0 ? 0 : nx <= cx ? nx - 1 : cx;
+	cy = cy < 0 ? 0 : ny <= cy ? ny - 1 : cy;
+	cz = cz < 0 ? 0 : nz <= cz ? nz - 1 : cz;
+}
+
+void NeighborGrid::Build(const AtomArrays &atoms, float minCellSize, bool parallel)
+{
+	slotOf.Clear();
+	extraHead.Clear();
+	extras.Clear();
+	unsigned n = atoms.GetSize();
+	order.Resize(n);
+	sx.Resize(n);
+	sy.Resize(n);
+	sz.Resize(n);
+	if (n == 0)
+	{
+		nx = ny = nz = 0;
+		cellStart.Resize(1);
+		cellStart[0] = 0;
+		return;
+	}
+
+	Vector3f lo = atoms.GetPos(0), hi = lo;
+	for (unsigned i = 1; i < n; i++)
+	{
+		lo.x = atoms.x[i] < lo.x ? atoms.x[i] : lo.x;
+		lo.y = atoms.y[i] < lo.y ? atoms.y[i] : lo.y;
+		lo.z = atoms.z[i] < lo.z ? atoms.z[i] : lo.z;
+		hi.x = hi.x < atoms.x[i] ? atoms.x[i] : hi.x;
+		hi.y = hi.y < atoms.y[i] ? atoms.y[i] : hi.y;
+		hi.z = hi.z < atoms.z[i] ? atoms.z[i] : hi.z;
+	}
+	origin = lo;
+
+	// Keep the cell count within a small multiple of the point count.
+	cellSize = minCellSize;
+	for (;;)
+	{
+		nx = int((hi.x - lo.x) / cellSize) + 1;
+		ny = int((hi.y - lo.y) / cellSize) + 1;
+		nz = int((hi.z - lo.z) / cellSize) + 1;
+		if (double(nx) * ny * nz <= 4. * n + 64)
+			break;
+		cellSize *= 1.5f;
+	}
+
+	// Counting sort of the points by cell.
+	Array<uint32_t> cellOfPoint;
+	cellOfPoint.Resize(n);
+	cellStart.Resize(nx * ny * nz + 1);
+	memset(&cellStart[0], 0, cellStart.GetSize() * sizeof(uint32_t));
+	auto findCells = [&](int begin, int end){
+		for (int i = begin; i < end; i++)
+		{
+			int cx, cy, cz;
+			CellOf(atoms.x[i], atoms.y[i], atoms.z[i], cx, cy, cz);
+			cellOfPoint[i] = CellIndex(cx, cy, cz);
+		}
+	};
+	if (parallel)
+		WorkerPool::Shared().ParallelFor(n, findCells);
+	else
+		findCells(0, n);
+	// The scatter stays serial so points keep their input order within a cell.
+	for (unsigned i = 0; i < n; i++)
+		cellStart[cellOfPoint[i] + 1]++;
+	for (unsigned c = 1; c < cellStart.GetSize(); c++)
+		cellStart[c] += cellStart[c - 1];
+
+	Array<uint32_t> fill;
+	fill.Resize(nx * ny * nz);
+	memcpy(&fill[0], &cellStart[0], fill.GetSize() * sizeof(uint32_t));
+	for (unsigned i = 0; i < n; i++)
+	{
+		uint32_t k = fill[cellOfPoint[i]]++;
+		order[k] = i;
+		sx[k] = atoms.x[i];
+		sy[k] = atoms.y[i];
+		sz[k] = atoms.z[i];
+	}
+}
+
+void NeighborGrid::FindPairs(float cutoff, Array<BondPair> &pairs) const
+{
+	OVR_ASSERT(cutoff <= cellSize);
+	float cutoff2 = cutoff * cutoff;
+
+	// Each cell layer collects its own pairs, then the layers are concatenated
+	// in order into ranges of the output sized from a prefix sum.
+	Array<Array<BondPair> > layers;
+	layers.Resize(nz);
+	WorkerPool &pool = WorkerPool::Shared();
+	pool.ParallelFor(nz, [&](int begin, int end){
+		for (int cz = begin; cz < end; cz++)
+			FindPairsInSlab(cutoff2, cz, cz + 1, layers[cz]);
+	});
+
+	Array<unsigned> offsets;
+	offsets.Resize(nz + 1);
+	offsets[0] = 0;
+	for (int cz = 0; cz < nz; cz++)
+		offsets[cz + 1] = offsets[cz] + (unsigned)layers[cz].GetSize();
+
+	pairs.Resize(offsets[nz]);
+	pool.ParallelFor(nz, [&](int begin, int end){
+		for (int cz = begin; cz < end; cz++)
+			if (layers[cz].GetSize())
+				memcpy(&pairs[offsets[cz]], &layers[cz][0], layers[cz].GetSize() * sizeof(BondPair));
+	});
+}
+
+void NeighborGrid::FindPairsInSlab(float cutoff2, int czBegin, int czEnd, Array<BondPair> &pairs) const
+{
+	for (int cz = czBegin; cz < czEnd; cz++)
+	for (int cy = 0; cy < ny; cy++)
+	for (int cx = 0; cx < nx; cx++)
+	{
+		int c = CellIndex(cx, cy, cz);
+		uint32_t begin = cellStart[c], end = cellStart[c + 1];
+		for (uint32_t i = begin; i < end; i++)
+		{
+			auto addPair = [&](uint32_t j){
+				float dx = sx[j] - sx[i], dy = sy[j] - sy[i], dz = sz[j] - sz[i];
+				if (dx * dx + dy * dy + dz * dz < cutoff2)
+				{
+					BondPair p;
+					p.a = order[i] < order[j] ? order[i] : order[j];
+					p.b = order[i] < order[j] ? order[j] : order[i];
+					pairs.PushBack(p);
+				}
+			};
+
+			for (uint32_t j = i + 1; j < end; j++)
+				addPair(j);
+
+			for (int s = 0; s < 13; s++)
+			{
+				int ox = cx + halfStencil[s][0], oy = cy + halfStencil[s][1], oz = cz + halfStencil[s][2];
+				if (ox < 0 || nx <= ox || oy < 0 || ny <= oy || nz <= oz)
+					continue;
+				int o = CellIndex(ox, oy, oz);
+				for (uint32_t j = cellStart[o]; j < cellStart[o + 1]; j++)
+					addPair(j);
+			}
+		}
+	}
+}
+
+void NeighborGrid::MapSlots()
+{
+	// The first update maps the sorted points back to their slots.
+	if (slotOf.GetSize() >= order.GetSize())
+		return;
+	slotOf.Resize(order.GetSize());
+	for (unsigned k = 0; k < order.GetSize(); k++)
+		slotOf[order[k]] = k;
+}
+
+void NeighborGrid::Insert(uint32_t index, const Vector3f &p)
+{
+	if (nx == 0)
+		return;
+	MapSlots();
+	if (extraHead.GetSize() == 0)
+	{
+		extraHead.Resize(nx * ny * nz);
+		for (unsigned c = 0; c < extraHead.GetSize(); c++)
+			extraHead[c] = None;
+	}
+	if (slotOf.GetSize() <= index)
+		slotOf.Resize(index + 1);
+
+	int cx, cy, cz;
+	CellOf(p.x, p.y, p.z, cx, cy, cz);
+	int c = CellIndex(cx, cy, cz);
+	Extra e;
+	e.index = index;
+	e.next = extraHead[c];
+	e.x = p.x;
+	e.y = p.y;
+	e.z = p.z;
+	extraHead[c] = (uint32_t)extras.GetSize();
+	slotOf[index] = ExtraFlag | extraHead[c];
+	extras.PushBack(e);
+}
+
+void NeighborGrid::Move(uint32_t index, const Vector3f &p)
+{
+	if (nx == 0)
+		return;
+	MapSlots();
+
+	// Points that stay in their cell are updated in place; the others leave
+	// a dead entry behind and are added again.
+	int cx, cy, cz, ox, oy, oz;
+	CellOf(p.x, p.y, p.z, cx, cy, cz);
+	uint32_t s = slotOf[index];
+	if (s & ExtraFlag)
+	{
+		Extra &e = extras[s & ~ExtraFlag];
+		CellOf(e.x, e.y, e.z, ox, oy, oz);
+		if (cx == ox && cy == oy && cz == oz)
+		{
+			e.x = p.x;
+			e.y = p.y;
+			e.z = p.z;
+			return;
+		}
+		e.index = None;
+	}
+	else
+	{
+		CellOf(sx[s], sy[s], sz[s], ox, oy, oz);
+		if (cx == ox && cy == oy && cz == oz)
+		{
+			sx[s] = p.x;
+			sy[s] = p.y;
+			sz[s] = p.z;
+			return;
+		}
+		order[s] = None;
+	}
+	Insert(index, p);
+}
+
+void NeighborGrid::FindNear(const Vector3f &p, float radius, Array<uint32_t> &found) const
+{
+	if (nx == 0)
+		return;
+	OVR_ASSERT(radius <= cellSize);
+	float radius2 = radius * radius;
+	int cx, cy, cz;
+	CellOf(p.x, p.y, p.z, cx, cy, cz);
+	for (int oz = cz - 1; oz <= cz + 1; oz++)
+	for (int oy = cy - 1; oy <= cy + 1; oy++)
+	for (int ox = cx - 1; ox <= cx + 1; ox++)
+	{
+		if (ox < 0 || nx <= ox || oy < 0 || ny <= oy || oz < 0 || nz <= oz)
+			continue;
+		int c = CellIndex(ox, oy, oz);
+		for (uint32_t k = cellStart[c]; k < cellStart[c + 1]; k++)
+		{
+			float dx = sx[k] - p.x, dy = sy[k] - p.y, dz = sz[k] - p.z;
+			if (order[k] != None && dx * dx + dy * dy + dz * dz < radius2)
+				found.PushBack(order[k]);
+		}
+		for (uint32_t e = extraHead.GetSize() ? extraHead[c] : None; e != None; e = extras[e].next)
+		{
+			float dx = extras[e].x - p.x, dy = extras[e].y - p.y, dz = extras[e].z - p.z;
+			if (extras[e].index != None && dx * dx + dy * dy + dz * dz < radius2)
+				found.PushBack(extras[e].index);
+		}
+	}
+}
+
+size_t NeighborGrid::GetMemoryUsage() const
+{
+	return (cellStart.GetSize() + order.GetSize() + slotOf.GetSize() + extraHead.GetSize()) * sizeof(uint32_t)
+		+ (sx.GetSize() + sy.GetSize() + sz.GetSize()) * sizeof(float) + extras.GetSize() * sizeof(Extra);
+}
+
+void FindBonds(const AtomArrays &atoms, float cutoff, Array<BondPair> &bonds)
+{
+	NeighborGrid grid;
+	grid.Build(atoms, cutoff);
+	grid.FindPairs(cutoff, bonds);
+}
@@ -0,0 +1,69 @@
+#ifndef NEIGHBORGRID_H
+#define NEIGHBORGRID_H
+
+#include "CrystalLattice.h"
+
+/// A cell list: points bucketed into a uniform grid of cubic cells, with the
+/// points of each cell stored contiguously. Finding every pair within a cutoff
+/// no longer than the cell size then only looks at adjacent cells, which is O(N).
+/// Points can be added and moved after Build() at O(1) each; they go to short
+/// lists per cell next to the sorted points, which are left as they are.
+class NeighborGrid
+{
+public:
+	NeighborGrid() : cellSize(1), nx(0), ny(0), nz(0){}
+
+	/// Buckets the points. Cells are at least cellSize wide; they grow when the
+	/// points are so sparse that the grid would have far more cells than points.
+	/// The shared WorkerPool is used unless parallel is false.
+	void Build(const AtomArrays &atoms, float cellSize, bool parallel = true);
+
+	/// Replaces pairs with every pair of points closer than cutoff, each pair once
+	/// with a < b. The cutoff must not exceed the cell size given to Build().
+	/// Slabs of cells are searched in parallel, but the pairs always come out in
+	/// the same order as a single-threaded search would produce. Points added or
+	/// moved since Build() are not supported.
+	void FindPairs(float cutoff, Array<BondPair> &pairs) const;
+
+	/// Adds point index at p. Indices continue those given to Build().
+	void Insert(uint32_t index, const Vector3f &p);
+	/// Moves point index to p.
+	void Move(uint32_t index, const Vector3f &p);
+	/// Appends every point closer than radius to p, which must not exceed the
+	/// cell size given to Build().
+	void FindNear(const Vector3f &p, float radius, Array<uint32_t> &found) const;
+
+	unsigned GetSize() const { return (unsigned)order.GetSize(); }
+	size_t GetMemoryUsage() const;
+
+protected:
+	int CellIndex(int cx, int cy, int cz) const { return (cz * ny + cy) * nx + cx; }
+	void CellOf(float px, float py, float pz, int &cx, int &cy, int &cz) const;
+	/// Appends the pairs whose first point lies in cell layers [czBegin, czEnd).
+	void FindPairsInSlab(float cutoff2, int czBegin, int czEnd, Array<BondPair> &pairs) const;
+	void MapSlots();
+
+	Vector3f origin;
+	float cellSize;
+	int nx, ny, nz;
+	Array<uint32_t> cellStart; ///< First entry of each cell in order; one extra at the end
+	Array<uint32_t> order;     ///< Point indices sorted by cell
+	Array<float> sx, sy, sz;   ///< Point positions in the same order, for locality
+
+	/// A point added or moved to another cell after Build().
+	struct Extra
+	{
+		uint32_t index, next; ///< next is the following Extra of the cell
+		float x, y, z;
+	};
+	static const uint32_t None = ~0u;       ///< Marks an empty link or a point that moved away
+	static const uint32_t ExtraFlag = 1u << 31; ///< Set in slotOf for points in extras
+	Array<uint32_t> slotOf;    ///< Entry of each point in order or extras; made by the first update
+	Array<uint32_t> extraHead; ///< First Extra of each cell
+	Array<Extra> extras;
+};
+
+/// Finds bonds between all atoms closer than cutoff using a NeighborGrid.
+void FindBonds(const AtomArrays &atoms, float cutoff, Array<BondPair> &bonds);
+
+#endif
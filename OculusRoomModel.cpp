@@ -22,6 +22,15 @@ limitations under the License.
 
 #include "OculusTest.h"
 #include "RenderTiny_D3D11_Device.h"
+#include "StaticBatch.h"
+#include "NeighborGrid.h"
+#include "WorkerPool.h"
+#include "SceneArena.h"
+#include "LatticeStream.h"
+#include "SceneFile.h"
+#include "Polycrystal.h"
+#include <atomic>
+#include <algorithm>
 
 
 enum BuiltinTexture
@@ -39,6 +48,9 @@ class FillCollection
 public:
     Ptr<ShaderFill> LitSolid;
     Ptr<ShaderFill> LitTextures[4];
+    Ptr<ShaderFill> AtomInstanced;
+    Ptr<ShaderFill> BondInstanced;
+    Ptr<ShaderFill> BlockInstanced;
 
     FillCollection(RenderDevice* render);
   
@@ -93,162 +105,1496 @@ FillCollection::FillCollection(RenderDevice* render)
         LitTextures[i]->SetTexture(0, builtinTextures[i]);
     }
 
+    AtomInstanced = *new ShaderFill(*render->CreateShaderSet());
+    AtomInstanced->GetShaders()->SetShader(render->LoadBuiltinShader(Shader_Vertex, VShader_AtomInstanced));
+    AtomInstanced->GetShaders()->SetShader(render->LoadBuiltinShader(Shader_Fragment, FShader_LitTexture));
+    AtomInstanced->SetTexture(0, builtinTextures[Tex_Checker]);
+    AtomInstanced->SetInputLayout(render->AtomInstanceIL);
+
+    BondInstanced = *new ShaderFill(*render->CreateShaderSet());
+    BondInstanced->GetShaders()->SetShader(render->LoadBuiltinShader(Shader_Vertex, VShader_BondInstanced));
+    BondInstanced->GetShaders()->SetShader(render->LoadBuiltinShader(Shader_Fragment, FShader_LitTexture));
+    BondInstanced->SetTexture(0, builtinTextures[Tex_Checker]);
+    BondInstanced->SetInputLayout(render->BondInstanceIL);
+
+    BlockInstanced = *new ShaderFill(*render->CreateShaderSet());
+    BlockInstanced->GetShaders()->SetShader(render->LoadBuiltinShader(Shader_Vertex, VShader_BlockInstanced));
+    BlockInstanced->GetShaders()->SetShader(render->LoadBuiltinShader(Shader_Fragment, FShader_LitTexture));
+    BlockInstanced->SetTexture(0, builtinTextures[Tex_Checker]);
+    BlockInstanced->SetInputLayout(render->BlockInstanceIL);
 }
 
 
+// Bond endpoints in structure-of-arrays form, so that ComputeBondInstances
+// can process every bond with the same straight-line arithmetic.
+struct BondEndpoints
+{
+	Array<float> X0, Y0, Z0, X1, Y1, Z1;
 
+	unsigned GetSize() const { return (unsigned)X0.GetSize(); }
 
+	// Copies the endpoints of each bond out of the atom arrays.
+	void Gather(const AtomArrays &atoms, const Array<BondPair> &bonds)
+	{
+		unsigned n = (unsigned)bonds.GetSize();
+		X0.Resize(n); Y0.Resize(n); Z0.Resize(n);
+		X1.Resize(n); Y1.Resize(n); Z1.Resize(n);
+		WorkerPool::Shared().ParallelFor(n, [&](int begin, int end){
+			for (int i = begin; i < end; i++)
+			{
+				uint32_t a = bonds[i].a, b = bonds[i].b;
+				X0[i] = atoms.x[a]; Y0[i] = atoms.y[a]; Z0[i] = atoms.z[a];
+				X1[i] = atoms.x[b]; Y1[i] = atoms.y[b]; Z1[i] = atoms.z[b];
+			}
+		});
+	}
+};
 
-// Adds atoms to form crystal system
-void SceneBuilder::PopulateRoomScene(Scene* scene, RenderDevice* render)
+// Computes midpoints, half lengths and orientations of all bonds at once.
+// The rotation taking (0,0,1) to the unit axis d is the shortest arc
+// quaternion (-d.y, d.x, 0, 1 + d.z) / sqrt(2 + 2 d.z). A bond looks the same
+// from either end, so d is flipped into the z >= 0 hemisphere first, which
+// removes the antiparallel singularity and every branch from the loop.
+static void ComputeBondInstances(const BondEndpoints &bonds, float radius, const Color &c, BondInstance *out)
 {
-	FillCollection fills(render);
+	static const float epsilon = 1e-5f;
+	unsigned n = bonds.GetSize();
+	if (n == 0)
+		return;
+
+	const float *x0 = &bonds.X0[0], *y0 = &bonds.Y0[0], *z0 = &bonds.Z0[0];
+	const float *x1 = &bonds.X1[0], *y1 = &bonds.Y1[0], *z1 = &bonds.Z1[0];
+
+	// Results in separate arrays so the first loop has no strided stores.
+	Array<float> qx, qy, qw, halfLen;
+	qx.Resize(n); qy.Resize(n); qw.Resize(n); halfLen.Resize(n);
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		float dx = x1[i] - x0[i], dy = y1[i] - y0[i], dz = z1[i] - z0[i];
+		float len = sqrt(dx * dx + dy * dy + dz * dz);
+		float inv = (dz < 0 ? -1.f : 1.f) / (len + epsilon);
+		dx *= inv; dy *= inv; dz *= inv;
+		float norm = 1.f / sqrt(2.f + 2.f * dz);
+		qx[i] = -dy * norm;
+		qy[i] = dx * norm;
+		qw[i] = (1.f + dz) * norm;
+		halfLen[i] = len * 0.5f;
+	}
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		BondInstance &b = out[i];
+		b.Pos = Vector3f((x0[i] + x1[i]) * 0.5f, (y0[i] + y1[i]) * 0.5f, (z0[i] + z1[i]) * 0.5f);
+		b.HalfLength = halfLen[i];
+		b.Rot = Quatf(qx[i], qy[i], 0, qw[i]);
+		b.Radius = radius;
+		b.C = c;
+	}
+}
+
+static const Color atomColor(127, 127, 127, 255);
+// Colors of the species, indexed by BasisAtom::species; substitutions cycle
+// through them too. The first is atomColor.
+static const Color speciesColors[] = {
+	atomColor, Color(200, 60, 60, 255), Color(60, 110, 220, 255), Color(220, 190, 50, 255),
+};
+static const int speciesCount = int(sizeof(speciesColors) / sizeof(speciesColors[0]));
+// Radii of the species in atom radii of the scene, one for each of speciesColors.
+static const float speciesRadii[speciesCount] = {1.f, 1.2f, 0.8f, 1.1f};
+static const float maxSpeciesRadius = 1.2f; ///< The largest of speciesRadii
+static const float pushDistance = 0.2f; ///< How far Edit_Push moves an atom
+static const float bondCutoff = 1.1f; ///< Longest bond in nearest neighbor distances
+static const float bondRadius = 0.05f;
+static const Color bondColor(127, 0, 127, 255);
+
+// Tessellations of the atom and bond levels of detail, finest first, and the
+// projected diameter in pixels down to which each is used. A bond of 0
+// segments is a line: 2 vertices instead of the 10 of the coarsest cylinder,
+// and no different to look at once that is about a pixel wide.
+static const struct { int slices, stacks; float minPixels; } sphereLods[] = {
+	{24, 12, 64}, {16, 8, 20}, {10, 5, 6}, {6, 3, 1.5f},
+};
+static const struct { int segments; float minPixels; } cylinderLods[] = {
+	{12, 16}, {6, 4}, {4, 1.5f}, {0, 0.5f},
+};
+// Extents with more bonds than this draw all of them as lines, at any distance.
+static const size_t maxCylinderBonds = 1 << 20;
+// Baked meshes are copied once per atom and bond, so they start from this
+// middle level of sphereLods and cylinderLods.
+static const int bakedLevel = 1;
+
+// Chunks are at least this wide, but grow so that no axis has more than
+// maxChunksPerAxis of them, which bounds the draw calls for big crystals.
+// A grown shell is hollow, so it is split more coarsely.
+static const float minChunkSize = 4.f;
+static const int maxChunksPerAxis = 12;
+static const int maxShellChunksPerAxis = 3;
+static const int supercellBlockCells = 4; ///< Most unit cells along each edge of a supercell block
+static const unsigned allBlockNeighbors = 63; ///< Every bit of CrystalScene::blockNeighbors
+static const float grainSize = 12.f; ///< Mean edge of a polycrystal grain in nearest neighbor distances
+static const float grainOverlap = 0.6f; ///< Closest atoms of two grains in nearest neighbor distances
+static const uint32_t grainSeed = 1234567u;
+
+// Returns the unit cells along each edge of the supercell blocks of an extent
+// of cells: the most up to supercellBlockCells that fill it exactly.
+static int GetSupercellBlockCells(int cells)
+{
+	int n = supercellBlockCells;
+	while (2 * cells % n)
+		n--;
+	return n;
+}
+
+// Returns the radius of an atom of species s in a scene of atom radius radius.
+static float GetSpeciesRadius(float radius, unsigned s)
+{
+	return radius * speciesRadii[s % speciesCount];
+}
+
+// Returns the instance of an atom of species s at pos. All species share one
+// instanced draw; only the color and radius of the instance tell them apart.
+static AtomInstance MakeAtomInstance(const Vector3f &pos, float radius, unsigned s)
+{
+	return AtomInstance(pos, GetSpeciesRadius(radius, s), speciesColors[s % speciesCount]);
+}
+
+// Sets the bounds of a LodInstancedModel from its instances of type T.
+template<class T>
+static void SetLodBounds(LodInstancedModel *model, float extent, float size)
+{
+	const T *inst = model->GetInstances<T>();
+	Vector3f lo = inst[0].Pos, hi = lo;
+	for (unsigned i = 1; i < model->GetInstanceCount(); i++)
+	{
+		const Vector3f &p = inst[i].Pos;
+		lo.x = min(lo.x, p.x); hi.x = max(hi.x, p.x);
+		lo.y = min(lo.y, p.y); hi.y = max(hi.y, p.y);
+		lo.z = min(lo.z, p.z); hi.z = max(hi.z, p.z);
+	}
+	model->BoundsCenter = (lo + hi) * 0.5f;
+	model->BoundsRadius = (hi - lo).Length() * 0.5f + extent;
+	model->InstanceSize = size;
+}
+
+// Splits instances into cubic chunks, each added to node as a LodInstancedModel
+// so that it picks its own level of detail, and to extentChunks. shells gives
+// the lattice shell of each instance. extent is how far an instance reaches
+// from its Pos and size its projected extent measured against the level
+// thresholds. The records of all chunks are one block of arena, sorted by
+// chunk and then shell, which is returned; if slots is given, the position of
+// each instance in it is stored there. Working storage comes from scratch.
+template<class T>
+static T *AddLodChunks(Container &node, const T *inst, const uint16_t *shells, unsigned count,
+	int chunksPerAxis, float extent, float size, const Array<LodInstancedModel::Level> &levels,
+	ShaderFill *fill, Array<ExtentChunk> &extentChunks, SceneArena &arena, SceneArena &scratch,
+	uint32_t *slots = NULL)
+{
+	if (count == 0)
+		return NULL;
+
+	Vector3f lo = inst[0].Pos, hi = lo;
+	for (unsigned i = 1; i < count; i++)
+	{
+		const Vector3f &p = inst[i].Pos;
+		lo.x = p.x < lo.x ? p.x : lo.x; hi.x = hi.x < p.x ? p.x : hi.x;
+		lo.y = p.y < lo.y ? p.y : lo.y; hi.y = hi.y < p.y ? p.y : hi.y;
+		lo.z = p.z < lo.z ? p.z : lo.z; hi.z = hi.z < p.z ? p.z : hi.z;
+	}
+	float longest = max(hi.x - lo.x, max(hi.y - lo.y, hi.z - lo.z));
+	float chunkSize = max(minChunkSize, longest / chunksPerAxis * 1.001f);
+	int nx = int((hi.x - lo.x) / chunkSize) + 1;
+	int ny = int((hi.y - lo.y) / chunkSize) + 1;
+	int nz = int((hi.z - lo.z) / chunkSize) + 1;
+
+	int minShell = shells[0], maxShell = shells[0];
+	for (unsigned i = 1; i < count; i++)
+	{
+		minShell = min(minShell, int(shells[i]));
+		maxShell = max(maxShell, int(shells[i]));
+	}
+	const unsigned shellCount = maxShell - minShell + 1;
+
+	// Counting sort of the instances by chunk, then shell.
+	unsigned keyCount = nx * ny * nz * shellCount;
+	uint32_t *keyOf = scratch.AllocArray<uint32_t>(count);
+	uint32_t *start = scratch.AllocArray<uint32_t>(keyCount + 1);
+	uint32_t *fillPos = scratch.AllocArray<uint32_t>(keyCount);
+	memset(start, 0, (keyCount + 1) * sizeof(uint32_t));
+	for (unsigned i = 0; i < count; i++)
+	{
+		const Vector3f &p = inst[i].Pos;
+		int cx = min(nx - 1, int((p.x - lo.x) / chunkSize));
+		int cy = min(ny - 1, int((p.y - lo.y) / chunkSize));
+		int cz = min(nz - 1, int((p.z - lo.z) / chunkSize));
+		keyOf[i] = ((cz * ny + cy) * nx + cx) * shellCount + shells[i] - minShell;
+		start[keyOf[i] + 1]++;
+	}
+
+	for (unsigned k = 0; k < keyCount; k++)
+		start[k + 1] += start[k];
+	memcpy(fillPos, start, keyCount * sizeof(uint32_t));
+
+	T *sorted = arena.AllocArray<T>(count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		uint32_t slot = fillPos[keyOf[i]]++;
+		sorted[slot] = inst[i];
+		if (slots)
+			slots[i] = slot;
+	}
+
+	for (unsigned k = 0; k < keyCount; k += shellCount)
+	{
+		const uint32_t *chunkStart = start + k;
+		if (chunkStart[0] == chunkStart[shellCount])
+			continue;
+		Ptr<LodInstancedModel> chunk = *new LodInstancedModel(levels, sizeof(T));
+		chunk->SetInstances(sorted + chunkStart[0], chunkStart[shellCount] - chunkStart[0]);
+		SetLodBounds<T>(chunk, extent, size);
+		chunk->Fill = fill;
+		node.Add(chunk);
+
+		ExtentChunk e;
+		e.model = chunk;
+		unsigned s = 0;
+		while (chunkStart[s + 1] == chunkStart[0])
+			s++;
+		e.firstShell = minShell + s;
+		for (; s < shellCount; s++)
+			e.ends.PushBack(chunkStart[s + 1] - chunkStart[0]);
+		extentChunks.PushBack(e);
+	}
+	return sorted;
+}
+
+// Returns the lattice shell of atom i of cs.atoms, which were generated for
+// cs.baseCells.
+static int GetAtomShell(const CrystalScene &cs, unsigned i)
+{
+	const LatticeDesc &lattice = GetLatticeDesc(cs.params.structure);
+	const int cells = cs.baseCells;
+	if (cs.params.IsPolycrystal())
+		return PolycrystalShell(GetPolycrystalCellSize(lattice), cells, cs.atoms.GetPos(i));
+
+	// The inverse of LatticeIndex().
+	const unsigned n = 2 * cells;
+	unsigned ix = i % n, rest = i / n / lattice.basisCount;
+	unsigned iy = rest % n, iz = rest / n;
+	return LatticeShell(int(ix) - cells, int(iy) - cells, int(iz) - cells);
+}
+
+// Returns the lattice shell of every atom of cs.atoms, allocated from scratch.
+static uint16_t *ComputeAtomShells(const CrystalScene &cs, SceneArena &scratch)
+{
+	unsigned count = cs.atoms.GetSize();
+	uint16_t *shells = scratch.AllocArray<uint16_t>(count);
+	WorkerPool::Shared().ParallelFor(count, [&](int begin, int end){
+		for (int i = begin; i < end; i++)
+			shells[i] = uint16_t(GetAtomShell(cs, i));
+	});
+	return shells;
+}
+
+// Returns the polycrystal PopulateRoomScene() makes of lattice for cells.
+static PolycrystalDesc GetPolycrystalDesc(const LatticeDesc &lattice, int cells)
+{
+	float edge = 2 * cells * GetPolycrystalCellSize(lattice) / (grainSize * NearestNeighborDistance(lattice));
+	PolycrystalDesc desc;
+	desc.cells = cells;
+	desc.grains = max(2, int(edge * edge * edge + 0.5f));
+	desc.seed = grainSeed;
+	desc.minDistance = grainOverlap * NearestNeighborDistance(lattice);
+	return desc;
+}
+
+// Tells the debugger what Govern() gave up for params, if anything.
+static void ReportDetail(const SceneParams &params, const SceneDetail &detail)
+{
+	const int finest = params.stream || (!params.bakeStatic && !params.supercell) ? 0 : bakedLevel;
+	const int lineLevel = int(sizeof(cylinderLods) / sizeof(cylinderLods[0])) - 1;
+	if (detail.atomLevel == finest && detail.bondLevel == finest && detail.bonds)
+		return;
+	char text[256];
+	int len = sprintf_s(text, "%s of %d cells coarsened to fit the budgets:",
+		GetLatticeDesc(params.structure).name, params.GetCells());
+	if (detail.atomLevel != finest)
+		len += sprintf_s(text + len, sizeof(text) - len, " spheres of %dx%d,",
+			sphereLods[detail.atomLevel].slices, sphereLods[detail.atomLevel].stacks);
+	if (!detail.bonds)
+		len += sprintf_s(text + len, sizeof(text) - len, " no bonds,");
+	else if (detail.bondLevel == lineLevel)
+		len += sprintf_s(text + len, sizeof(text) - len, " bonds as lines,");
+	else if (detail.bondLevel != finest)
+		len += sprintf_s(text + len, sizeof(text) - len, " cylinders of %d segments,", cylinderLods[detail.bondLevel].segments);
+	sprintf_s(text + len, sizeof(text) - len, " %.1f million triangles, %u MB\n",
+		detail.triangles / 1e6, unsigned(detail.bytes >> 20));
+	OutputDebugStringA(text);
+}
+
+// Scenes are built on the render thread at startup and on the build thread later.
+static std::atomic<unsigned> lastSceneSerial(0);
+
+// Adds atoms to form crystal system. Runs on the build thread, so it only
+// touches CPU-side data; GPU buffers are created when the scene is first rendered.
+bool SceneBuilder::PopulateRoomScene(const SceneParams &params, CrystalScene &cs, const SceneFile *file) const
+{
+	cs.serial = ++lastSceneSerial;
+	cs.params = params;
+	cs.params.cells = params.GetCells();
+	cs.generatedCells = cs.baseCells = cs.params.cells;
+	cs.detail = Govern(params);
+	ReportDetail(params, cs.detail);
+	cs.scene.Clear();
+	cs.arena.Reset();
+	scratch.Reset();
+
+    cs.scene.SetAmbient(Vector4f(0.65f,0.65f,0.65f,1));
+    cs.scene.AddLight(Vector3f(-2,4,-2), Vector4f(8,8,8,1));
+    cs.scene.AddLight(Vector3f(3,4,-3),  Vector4f(2,1,1,1));
+    cs.scene.AddLight(Vector3f(-4,3,25), Vector4f(3,6,3,1));
+
+	cs.atomNode = *new Container;
+	cs.bondNode = *new Container;
+	cs.atomNode->SetVisible(params.drawAtom);
+	cs.bondNode->SetVisible(params.drawBond);
+	cs.scene.World.Add(cs.atomNode);
+	cs.scene.World.Add(cs.bondNode);
+
+	const LatticeDesc &lattice = GetLatticeDesc(params.structure);
+	if (params.supercell && !params.stream)
+	{
+		// One block is built; the extent only decides where it is drawn.
+		BuildSupercell(params, cs);
+		LayoutBlocks(cs);
+		return true;
+	}
+	if (params.stream)
+	{
+		// Chunks are made by the stream as the viewer moves, always instanced.
+		SceneParams snapshot = params;
+		cs.stream = new LatticeStream(lattice, NearestNeighborDistance(lattice) * bondCutoff, *cs.atomNode, *cs.bondNode,
+			[this, snapshot](const AtomArrays &atoms, unsigned coreCount, const Array<BondPair> &bonds,
+				Ptr<Node> &atomNode, Ptr<Node> &bondNode){
+				BuildChunkNodes(snapshot, atoms, coreCount, bonds, atomNode, bondNode);
+			});
+		return true;
+	}
+
+	if (file)
+	{
+		// Saved by an earlier run from the same parameters, baked meshes too.
+		file->ReadAtoms(cs.atoms);
+		file->ReadBonds(cs.bonds);
+		SortBonds(cs.atoms.GetSize(), cs.bonds);
+		if (params.bakeStatic)
+		{
+			file->ReadMeshes(*cs.atomNode, *cs.bondNode, bakedFill);
+			return true;
+		}
+	}
+	else
+	{
+		if (params.IsPolycrystal())
+			GeneratePolycrystal(lattice, GetPolycrystalDesc(lattice, cs.params.cells), cs.atoms);
+		else
+			GenerateLattice(lattice, cs.params.cells, cs.atoms);
+		if (Superseded())
+			return false;
+		// Bonds are found even when hidden so that showing them is instant,
+		// unless the scene is too big to have any.
+		if (cs.detail.bonds)
+			FindBonds(cs.atoms, NearestNeighborDistance(lattice) * bondCutoff, cs.bonds);
+		SortBonds(cs.atoms.GetSize(), cs.bonds);
+		if (Superseded())
+			return false;
+	}
 
-	scene->World.Clear();
+	const uint16_t *atomShells = params.bakeStatic ? NULL : ComputeAtomShells(cs, scratch);
+	BuildAtoms(params, cs, atomShells);
+	if (Superseded())
+		return false;
+	BuildBonds(params, cs, atomShells);
+	return true;
+}
 
-	// Returns a quaternion representing rotation that transforms (0,0,1) vector
-	// so that it's parallel to the given vector.
-	auto direction = [](const Vector3f &dir){
-		static const double epsilon = 1e-5f;
-		double p;
-		Quatf ret;
-		if (dir.LengthSq() <= epsilon)
-			return Quatf(0, 0, 0, 1);
-		Vector3f dr = dir.Normalized();
+void SceneBuilder::Apply(CrystalScene &cs, bool newChunks)
+{
+	if (cs.IsInstanced() && (cs.params.scale != scale || newChunks))
+	{
+		// Only the radius field changes, scaled so that every species keeps
+		// its own size; the mesh stays and the instance buffers are
+		// overwritten in place on the next frame. This runs on the render
+		// thread, which must not wait for the worker pool while the build
+		// thread is using it, so the loop is serial. Streamed chunks may have
+		// been made with an older radius, so each chunk is checked.
+		const float radius = GetAtomRadius();
+		for (unsigned c = 0; c < cs.atomNode->Nodes.GetSize(); c++)
+		{
+			LodInstancedModel *chunk = (LodInstancedModel*)cs.atomNode->Nodes[c].GetPtr();
+			AtomInstance *inst = chunk->GetInstances<AtomInstance>();
+			float oldRadius = chunk->InstanceSize * 0.5f;
+			if (oldRadius == radius)
+				continue;
+			// Removed atoms stay at radius 0.
+			const float ratio = radius / oldRadius;
+			for (unsigned i = 0; i < chunk->GetInstanceCount(); i++)
+				inst[i].Radius *= ratio;
+			chunk->InvalidateInstances();
+			chunk->BoundsRadius += (radius - oldRadius) * maxSpeciesRadius;
+			chunk->InstanceSize = 2 * radius;
+		}
+		cs.params.scale = scale;
+	}
 
-		/* half-angle formula of trigonometry replaces expensive tri-functions to square root */
-		ret.w = ::sqrt((dr[2] + 1) / 2) /*cos(acos(dr[2]) / 2.)*/;
+	if (cs.blockCells)
+	{
+		// Supercell blocks are laid out for any extent they divide; the
+		// build thread makes a block for the others.
+		if ((GetCells() != cs.params.cells || newChunks) && 2 * GetCells() % cs.blockCells == 0)
+		{
+			cs.params.cells = GetCells();
+			LayoutBlocks(cs);
+		}
+	}
+	else if (cs.IsInstanced() && !cs.stream)
+	{
+		// Draw the prefix of each chunk that lies within the extent, as far as
+		// it has been generated; the build thread grows the rest.
+		int shown = min(GetCells(), cs.generatedCells);
+		if (shown != cs.params.cells || newChunks)
+		{
+			for (unsigned c = 0; c < cs.extentChunks.GetSize(); c++)
+				cs.extentChunks[c].model->SetDrawCount(cs.extentChunks[c].GetCount(shown));
+			cs.params.cells = shown;
 
-		if (1 - epsilon < ret.w){
-			ret.x = ret.y = ret.z = 0;
+			// Bonds switch between cylinders and lines with the number drawn,
+			// which only swaps the meshes the chunks pick from.
+			size_t bondCount = 0;
+			for (unsigned c = 0; c < cs.bondNode->Nodes.GetSize(); c++)
+				bondCount += ((LodInstancedModel*)cs.bondNode->Nodes[c].GetPtr())->GetDrawCount();
+			Array<LodInstancedModel::Level> levels = GetBondLevels(cs.detail, bondCount);
+			for (unsigned c = 0; c < cs.bondNode->Nodes.GetSize(); c++)
+			{
+				LodInstancedModel *chunk = (LodInstancedModel*)cs.bondNode->Nodes[c].GetPtr();
+				if (chunk->Levels.GetSize() == levels.GetSize())
+					continue;
+				chunk->Levels = levels;
+				chunk->CurrentLevel = 0;
+			}
 		}
-		else if (ret.w < epsilon){
-			ret.x = ret.z = 0;
-			ret.y = 1;
+	}
+
+	cs.atomNode->SetVisible(drawAtom);
+	cs.bondNode->SetVisible(drawBond);
+	cs.params.drawAtom = drawAtom;
+	cs.params.drawBond = drawBond;
+}
+
+void SceneBuilder::BuildAtoms(const SceneParams &params, CrystalScene &cs, const uint16_t *atomShells) const
+{
+	const float radius = params.GetAtomRadius();
+	const AtomArrays &atoms = cs.atoms;
+	unsigned count = atoms.GetSize();
+	if (params.bakeStatic)
+	{
+		// The crystal does not move, so copy every atom into a few chunk
+		// meshes drawn with the plain lit fill.
+		StaticBatch batch;
+		const Model *sphere = atomLevels[cs.detail.atomLevel].Mesh;
+		for (unsigned i = 0; i < count; i++)
+		{
+			float r = GetSpeciesRadius(radius, atoms.species[i]);
+			batch.Add(sphere, bakedFill, Matrix4f::Translation(atoms.GetPos(i)) * Matrix4f::Scaling(r),
+				speciesColors[atoms.species[i] % speciesCount]);
 		}
-		else{
-			Vector3f v = Vector3f(0,0,1).Cross(dr);
-			p = sqrt(1 - ret.w * ret.w) / (v.Length());
-			ret.x = v[0] * p;
-			ret.y = v[1] * p;
-			ret.z = v[2] * p;
+		batch.Build(*cs.atomNode);
+	}
+	else if (count)
+	{
+		// Atoms share unit spheres and are drawn with an instanced call per chunk.
+		AtomInstance *inst = scratch.AllocArray<AtomInstance>(count);
+		WorkerPool::Shared().ParallelFor(count, [&](int begin, int end){
+			for (int i = begin; i < end; i++)
+				inst[i] = MakeAtomInstance(atoms.GetPos(i), radius, atoms.species[i]);
+		});
+		cs.atomSlots = cs.arena.AllocArray<uint32_t>(count);
+		cs.atomRecords = AddLodChunks(*cs.atomNode, inst, atomShells, count, maxChunksPerAxis,
+			radius * maxSpeciesRadius, 2 * radius, GetAtomLevels(cs.detail), atomFill, cs.extentChunks, cs.arena, scratch,
+			cs.atomSlots);
+	}
+}
+
+void SceneBuilder::BuildBonds(const SceneParams &params, CrystalScene &cs, const uint16_t *atomShells) const
+{
+	// Bond endpoints gathered for the batched orientation computation.
+	BondEndpoints endpoints;
+	endpoints.Gather(cs.atoms, cs.bonds);
+	unsigned count = endpoints.GetSize();
+	if (count == 0)
+		return;
+
+	BondInstance *bondInstances = scratch.AllocArray<BondInstance>(count);
+	ComputeBondInstances(endpoints, bondRadius, bondColor, bondInstances);
+
+	if (params.bakeStatic)
+	{
+		StaticBatch batch;
+		const Model *mesh = count > maxCylinderBonds ? bondLevels.Back().Mesh : bondLevels[cs.detail.bondLevel].Mesh;
+		for (unsigned i = 0; i < count; i++)
+		{
+			const BondInstance &b = bondInstances[i];
+			batch.Add(mesh, bakedFill, Matrix4f::Translation(b.Pos) * Matrix4f(b.Rot)
+				* Matrix4f::Scaling(Vector3f(b.Radius, b.Radius, b.HalfLength)), b.C);
 		}
-		return ret;
-	};
+		batch.Build(*cs.bondNode);
+	}
+	else
+	{
+		// A bond appears with the outer of its atoms.
+		const Array<BondPair> &bonds = cs.bonds;
+		uint16_t *bondShells = scratch.AllocArray<uint16_t>(count);
+		for (unsigned i = 0; i < count; i++)
+			bondShells[i] = max(atomShells[bonds[i].a], atomShells[bonds[i].b]);
 
-	// Creates a bond cylinder between the given points
-	auto addBond = [&](const Vector3f &p0, const Vector3f &p1){
-		Vector3f diff = p1 - p0;
-		Quatf dir = direction(diff);
-		Model *cyl = new Model(Prim_Triangles);
-		cyl->AddCylinder(0.05, diff.Length() * 0.5f);
-		cyl->SetPosition((p0 + p1) * 0.5f);
-		cyl->SetOrientation(dir);
-		cyl->Fill = fills.LitTextures[Tex_Checker];
-		scene->World.Add(Ptr<Model>(*cyl));
-	};
+		// Bonds are no longer than the search cutoff.
+		float halfLength = NearestNeighborDistance(GetLatticeDesc(params.structure)) * 0.55f;
+		cs.bondSlots = cs.arena.AllocArray<uint32_t>(count);
+		cs.bondRecords = AddLodChunks(*cs.bondNode, bondInstances, bondShells, count, maxChunksPerAxis,
+			halfLength + bondRadius, 2 * bondRadius, GetBondLevels(cs.detail, count), bondFill, cs.extentChunks, cs.arena,
+			scratch, cs.bondSlots);
+	}
+}
 
-	// Add an atom at specified position in space
-	auto add = [&](float x, float y, float z){
-		Model *sphere = new Model(Prim_Triangles);
-		sphere->AddSphere(float(0.5 * scale));
-		sphere->SetPosition(Vector3f(x, y, z));
-		sphere->Fill = fills.LitTextures[Tex_Checker];
-		scene->World.Add(Ptr<Model>(*sphere));
-	};
+Array<LodInstancedModel::Level> SceneBuilder::GetAtomLevels(const SceneDetail &detail) const
+{
+	Array<LodInstancedModel::Level> levels;
+	for (unsigned i = detail.atomLevel; i < atomLevels.GetSize(); i++)
+		levels.PushBack(atomLevels[i]);
+	return levels;
+}
 
-	// Add method in vector form
-	auto addv = [&](const Vector3f &v){
-		add(v.x, v.y, v.z);
-	};
+Array<LodInstancedModel::Level> SceneBuilder::GetBondLevels(const SceneDetail &detail, size_t bondCount) const
+{
+	Array<LodInstancedModel::Level> levels;
+	for (unsigned i = bondCount > maxCylinderBonds ? bondLevels.GetSize() - 1 : detail.bondLevel; i < bondLevels.GetSize(); i++)
+		levels.PushBack(bondLevels[i]);
+	return levels;
+}
+
+// Runs on the build thread while cs may be rendered, so it only allocates
+// from cs.arena, which the render thread never touches.
+void SceneBuilder::BuildShell(const SceneParams &params, int k, CrystalScene &cs, CrystalShell &shell) const
+{
+	scratch.Reset();
+	shell.serial = cs.serial;
+	shell.shell = k;
+	shell.atomNode = *new Container;
+	shell.bondNode = *new Container;
+
+	// The new shell after the outermost existing one, so that the bonds
+	// between them are found too. Bonds within the old shell already exist.
+	const LatticeDesc &lattice = GetLatticeDesc(params.structure);
+	AtomArrays atoms, layer;
+	GenerateLatticeShell(lattice, k ? k - 1 : 0, k, atoms);
+	const unsigned inner = atoms.GetSize();
+	GenerateLatticeShell(lattice, k, k + 1, layer);
+	const unsigned count = layer.GetSize();
+	atoms.Resize(inner + count);
+	atoms.Copy(inner, layer, 0, count);
+
+	Array<BondPair> found, bonds;
+	if (cs.detail.bonds)
+		FindBonds(atoms, NearestNeighborDistance(lattice) * bondCutoff, found);
+	for (unsigned i = 0; i < found.GetSize(); i++)
+		if (found[i].a >= inner || found[i].b >= inner)
+			bonds.PushBack(found[i]);
+
+	const float radius = params.GetAtomRadius();
+	AtomInstance *inst = scratch.AllocArray<AtomInstance>(count);
+	uint16_t *shells = scratch.AllocArray<uint16_t>(count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		inst[i] = MakeAtomInstance(atoms.GetPos(inner + i), radius, atoms.species[inner + i]);
+		shells[i] = uint16_t(k);
+	}
+	AddLodChunks(*shell.atomNode, inst, shells, count, maxShellChunksPerAxis, radius * maxSpeciesRadius,
+		2 * radius, GetAtomLevels(cs.detail), atomFill, shell.extentChunks, cs.arena, scratch);
+
+	BondEndpoints endpoints;
+	endpoints.Gather(atoms, bonds);
+	unsigned bondCount = endpoints.GetSize();
+	if (bondCount == 0)
+		return;
+	BondInstance *bondInstances = scratch.AllocArray<BondInstance>(bondCount);
+	ComputeBondInstances(endpoints, bondRadius, bondColor, bondInstances);
+	uint16_t *bondShells = scratch.AllocArray<uint16_t>(bondCount);
+	for (unsigned i = 0; i < bondCount; i++)
+		bondShells[i] = uint16_t(k);
+	float halfLength = NearestNeighborDistance(lattice) * 0.55f;
+	AddLodChunks(*shell.bondNode, bondInstances, bondShells, bondCount, maxShellChunksPerAxis, halfLength + bondRadius,
+		2 * bondRadius, GetBondLevels(cs.detail, 0), bondFill, shell.extentChunks, cs.arena, scratch);
+}
+
+bool CrystalScene::Serves(const SceneParams &p, const SceneDetail &d) const
+{
+	// A stream depends on where the viewer has been, so it is never reused.
+	if (stream || p.stream || params.structure != p.structure || params.supercell != p.supercell)
+		return false;
+	// A scene coarsened for a big extent is not shown for a small one, nor
+	// the other way around.
+	if (detail != d)
+		return false;
+	// A supercell block has the radius in its vertices, but fits any extent
+	// it divides.
+	if (p.supercell)
+		return params.scale == p.scale && blockCells == GetSupercellBlockCells(p.GetCells());
+	if (params.bakeStatic != p.bakeStatic || params.IsPolycrystal() != p.IsPolycrystal())
+		return false;
+	// The grains of a polycrystal depend on its extent, so it can shrink but never grow.
+	if (p.IsPolycrystal() && !p.bakeStatic && generatedCells < p.GetCells())
+		return false;
+	// Baked meshes have the extent and radius in their vertices.
+	return !p.bakeStatic || (params.cells == p.GetCells() && params.scale == p.scale);
+}
+
+static size_t GetNodeMemoryUsage(const Node *node)
+{
+	switch (node->GetType())
+	{
+	case Node::Node_Container:
+	{
+		const Container *c = (const Container*)node;
+		size_t size = 0;
+		for (unsigned i = 0; i < c->Nodes.GetSize(); i++)
+			size += GetNodeMemoryUsage(c->Nodes[i]);
+		return size;
+	}
+	case Node::Node_Model:
+	{
+		const Model *m = (const Model*)node;
+		return 2 * (m->Vertices.GetSize() * sizeof(Vertex) + m->Indices.GetSize() * sizeof(uint32_t));
+	}
+	case Node::Node_InstancedModel:
+	{
+		// Records in the scene's arena are counted with it.
+		const InstancedModel *m = (const InstancedModel*)node;
+		return m->InstanceData.GetSize() + m->GetInstanceCount() * m->InstanceStride;
+	}
+	default:
+		return 0;
+	}
+}
+
+size_t CrystalScene::GetMemoryUsage() const
+{
+	size_t size = arena.GetCapacity() + atoms.GetSize() * (3 * sizeof(float) + sizeof(uint16_t)) + bonds.GetSize() * sizeof(BondPair)
+		+ store.GetMemoryUsage() + grid.GetMemoryUsage() + addedBonds.GetSize() * sizeof(BondPair)
+		+ graph.GetMemoryUsage() + (addedBondHead.GetSize() + addedBondNext.GetSize()) * sizeof(uint32_t);
+	if (atomNode)
+		size += GetNodeMemoryUsage(atomNode);
+	if (bondNode)
+		size += GetNodeMemoryUsage(bondNode);
+	// Block meshes are not nodes of their own.
+	if (atomBlocks)
+		size += GetNodeMemoryUsage(atomBlocks->Mesh);
+	for (unsigned i = 0; i <= faceBonds.GetSize(); i++)
+	{
+		const BlockBonds &b = i < faceBonds.GetSize() ? faceBonds[i] : bondBlocks;
+		if (b.model)
+			size += GetNodeMemoryUsage(b.cylinders) + GetNodeMemoryUsage(b.lines);
+	}
+	return size + blocks.GetSize() * (sizeof(Vector3f) + sizeof(uint8_t));
+}
+
+SceneDetail SceneBuilder::Govern(const SceneParams &params) const
+{
+	SceneDetail detail;
+	if (params.stream)
+		return detail;
+	const bool instanced = !params.bakeStatic && !params.supercell;
+	if (!instanced)
+		detail.atomLevel = detail.bondLevel = bakedLevel;
+
+	// Atoms and bonds drawn, from the density of the infinite lattice, and
+	// those in buffers, which for supercells are only one block's.
+	const LatticeDesc &lattice = GetLatticeDesc(params.structure);
+	const int cells = params.GetCells();
+	double drawnCells = 8.0 * cells * cells * cells, storedCells = drawnCells;
+	if (params.supercell)
+	{
+		const int n = GetSupercellBlockCells(cells);
+		storedCells = n * n * n;
+	}
+	else if (params.IsPolycrystal())
+	{
+		double edge = 2 * cells * GetPolycrystalCellSize(lattice);
+		drawnCells = storedCells = edge * edge * edge / fabs(lattice.a.Dot(lattice.b.Cross(lattice.c)));
+	}
+	const double bondsPerAtom = double(CountBondsPerCell(lattice, NearestNeighborDistance(lattice) * bondCutoff))
+		/ lattice.basisCount;
+	const double atoms = drawnCells * lattice.basisCount, bonds = atoms * bondsPerAtom;
+	const double storedAtoms = storedCells * lattice.basisCount, storedBonds = storedAtoms * bondsPerAtom;
+	const int lineLevel = (int)bondLevels.GetSize() - 1;
+	const bool manyBonds = bonds > maxCylinderBonds; // Drawn as lines at any level
+	auto triangles = [](const Model *mesh){ return mesh->Type == Prim_Triangles ? mesh->Indices.GetSize() / 3.0 : 0.0; };
+
+	for (;;)
+	{
+		const Model *sphere = atomLevels[detail.atomLevel].Mesh;
+		const Model *cylinder = bondLevels[manyBonds ? lineLevel : detail.bondLevel].Mesh;
+		const double atomTriangles = atoms * triangles(sphere);
+		const double bondTriangles = detail.bonds ? bonds * triangles(cylinder) : 0;
+		double bytes;
+		if (instanced)
+			bytes = 2 * (atoms * sizeof(AtomInstance) + (detail.bonds ? bonds * sizeof(BondInstance) : 0));
+		else
+		{
+			// A supercell block keeps its bonds as lines too, and both once
+			// more split for the faces.
+			bytes = storedAtoms * GetNodeMemoryUsage(sphere);
+			if (detail.bonds)
+				bytes += storedBonds * (params.supercell
+					? 2 * (GetNodeMemoryUsage(cylinder) + GetNodeMemoryUsage(bondLevels.Back().Mesh))
+					: GetNodeMemoryUsage(cylinder));
+		}
+		detail.triangles = uint64_t(atomTriangles + bondTriangles);
+		detail.bytes = uint64_t(bytes);
+
+		const bool overTriangles = detail.triangles > triangleBudget;
+		if (!overTriangles && detail.bytes <= geometryBudget)
+			break;
+		// Tessellation only changes the bytes of baked meshes.
+		const bool coarsen = overTriangles || !instanced;
+		const bool atomCoarsens = detail.atomLevel + 1 < (int)atomLevels.GetSize();
+		const bool bondCoarsens = detail.bonds && !manyBonds && detail.bondLevel < lineLevel;
+		if (coarsen && atomCoarsens && (atomTriangles >= bondTriangles || !bondCoarsens))
+			detail.atomLevel++;
+		else if (coarsen && bondCoarsens)
+			detail.bondLevel++;
+		else if (detail.bonds)
+			detail.bonds = false;
+		else
+			break; // The atoms alone do not fit, but are drawn as coarsely as they can be
+	}
+	return detail;
+}
+
+static const uint32_t noBond = ~0u;
+
+// Returns the longest bond of the structure of cs.
+static float GetBondCutoff(const CrystalScene &cs)
+{
+	return NearestNeighborDistance(GetLatticeDesc(cs.params.structure)) * bondCutoff;
+}
+
+bool SceneBuilder::PrepareEdits(CrystalScene &cs)
+{
+	if (!cs.IsInstanced() || cs.stream || !cs.atomRecords)
+		return false;
+	if (cs.addedAtomModel)
+		return true;
+
+	// The first edit copies the atoms into the store, indexes the bonds of
+	// each atom and buckets the atoms for finding new bonds, so that unedited
+	// scenes pay for none of it. This runs on the render thread, which must
+	// not wait for the worker pool, so it is all serial.
+	cs.store.Init(cs.atoms);
+	cs.grid.Build(cs.atoms, GetBondCutoff(cs), false);
+	unsigned n = cs.atoms.GetSize();
+	cs.graph.Build(n, cs.bonds, false);
+	cs.addedBondHead.Resize(n);
+	for (unsigned i = 0; i < n; i++)
+		cs.addedBondHead[i] = noBond;
+
+	// The chunks by the address of their records, to find the one to upload.
+	cs.editModels.Clear();
+	for (unsigned c = 0; c < cs.extentChunks.GetSize(); c++)
+		cs.editModels.PushBack(cs.extentChunks[c].model);
+	std::sort(&cs.editModels[0], &cs.editModels[0] + cs.editModels.GetSize(),
+		[](const InstancedModel *a, const InstancedModel *b){ return a->Instances < b->Instances; });
+
+	// Added atoms and bonds have models of their own.
+	cs.addedAtomModel = *new LodInstancedModel(GetAtomLevels(cs.detail), sizeof(AtomInstance));
+	cs.addedAtomModel->Fill = atomFill;
+	cs.addedAtomModel->InstanceSize = 2 * cs.params.GetAtomRadius();
+	cs.atomNode->Add(cs.addedAtomModel);
+	cs.addedBondModel = *new LodInstancedModel(GetBondLevels(cs.detail, 0), sizeof(BondInstance));
+	cs.addedBondModel->Fill = bondFill;
+	cs.addedBondModel->InstanceSize = 2 * bondRadius;
+	cs.bondNode->Add(cs.addedBondModel);
+	return true;
+}
+
+// Marks record, which is in one of models sorted by address, for upload.
+static void InvalidateRecord(const Array<InstancedModel*> &models, const void *record)
+{
+	unsigned lo = 0, hi = models.GetSize();
+	while (lo < hi)
+	{
+		unsigned mid = (lo + hi) / 2;
+		if (models[mid]->Instances <= record)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return;
+	InstancedModel *model = models[lo - 1];
+	unsigned index = unsigned(((const uint8_t*)record - model->Instances) / model->InstanceStride);
+	if (index < model->GetInstanceCount())
+		model->InvalidateInstances(index, 1);
+}
+
+// Returns the record of atom i and marks it for upload.
+static AtomInstance &GetAtomRecord(CrystalScene &cs, unsigned i)
+{
+	unsigned base = cs.atoms.GetSize();
+	if (i < base)
+	{
+		AtomInstance &r = cs.atomRecords[cs.atomSlots[i]];
+		InvalidateRecord(cs.editModels, &r);
+		return r;
+	}
+	cs.addedAtomModel->InvalidateInstances(i - base, 1);
+	return cs.addedAtomModel->GetInstances<AtomInstance>()[i - base];
+}
+
+// Returns the record of bond b and marks it for upload.
+static BondInstance &GetBondRecord(CrystalScene &cs, unsigned b)
+{
+	unsigned base = (unsigned)cs.bonds.GetSize();
+	if (b < base)
+	{
+		BondInstance &r = cs.bondRecords[cs.bondSlots[b]];
+		InvalidateRecord(cs.editModels, &r);
+		return r;
+	}
+	cs.addedBondModel->InvalidateInstances(b - base, 1);
+	return cs.addedBondModel->GetInstances<BondInstance>()[b - base];
+}
+
+static const BondPair &GetBond(const CrystalScene &cs, unsigned b)
+{
+	return b < cs.bonds.GetSize() ? cs.bonds[b] : cs.addedBonds[b - cs.bonds.GetSize()];
+}
+
+// Calls f with each bond of atom i.
+template<class F>
+static void ForEachBond(const CrystalScene &cs, unsigned i, F f)
+{
+	if (i < cs.atoms.GetSize())
+		cs.graph.ForEachBond(i, [&](unsigned, uint32_t b){ f(b); });
+	for (uint32_t j = cs.addedBondHead[i]; j != noBond; j = cs.addedBondNext[2 * j + (cs.addedBonds[j].a == i ? 0 : 1)])
+		f((unsigned)cs.bonds.GetSize() + j);
+}
+
+// Appends count default records to a model of added atoms or bonds, doubling
+// its storage when full, and returns them.
+template<class T>
+static T *AddRecords(LodInstancedModel &model, unsigned count)
+{
+	unsigned used = model.GetDrawCount(), capacity = model.GetInstanceCount();
+	if (capacity < used + count)
+	{
+		unsigned grown = capacity < 64 ? 64 : 2 * capacity;
+		grown = grown < used + count ? used + count : grown;
+		T *inst = model.ResizeInstances<T>(grown);
+		for (unsigned i = used; i < grown; i++)
+			inst[i] = T();
+	}
+	model.SetDrawCount(used + count);
+	return model.GetInstances<T>() + used;
+}
+
+// Grows the bounds of a model of added records to include one at p.
+static void AddToBounds(LodInstancedModel &model, const Vector3f &p, float extent)
+{
+	if (model.BoundsRadius == 0)
+	{
+		model.BoundsCenter = p;
+		model.BoundsRadius = extent;
+		return;
+	}
+	float reach = (p - model.BoundsCenter).Length() + extent;
+	if (model.BoundsRadius < reach)
+		model.BoundsRadius = reach;
+}
+
+// Adds a bond between atoms a and b; its record is filled by PatchAtoms().
+static void AddBond(CrystalScene &cs, uint32_t a, uint32_t b)
+{
+	uint32_t j = (uint32_t)cs.addedBonds.GetSize();
+	BondPair p;
+	p.a = a;
+	p.b = b;
+	cs.addedBonds.PushBack(p);
+	cs.addedBondNext.PushBack(cs.addedBondHead[a]);
+	cs.addedBondNext.PushBack(cs.addedBondHead[b]);
+	cs.addedBondHead[a] = cs.addedBondHead[b] = j;
+	AddRecords<BondInstance>(*cs.addedBondModel, 1);
+	AddToBounds(*cs.addedBondModel, cs.store.Get(a).GetPos(), GetBondCutoff(cs) + bondRadius);
+}
+
+int SceneBuilder::PickAtom(const CrystalScene &cs) const
+{
+	// The nearest shown atom the view ray passes through.
+	const float radius = cs.params.GetAtomRadius();
+	int picked = -1;
+	float nearest = 1e30f;
+	for (unsigned i = 0; i < cs.store.GetSize(); i++)
+	{
+		const StoredAtom &a = cs.store.Get(i);
+		if (a.removed || (i < cs.atoms.GetSize() && GetAtomShell(cs, i) >= cs.params.cells))
+			continue;
+		Vector3f d = a.GetPos() - viewPos;
+		float t = d.Dot(viewDir), r = GetSpeciesRadius(radius, a.species);
+		if (t <= 0 || nearest <= t || r * r < d.LengthSq() - t * t)
+			continue;
+		nearest = t;
+		picked = int(i);
+	}
+	return picked;
+}
+
+void SceneBuilder::PatchAtoms(CrystalScene &cs, const Array<uint32_t> &changed)
+{
+	const float radius = cs.params.GetAtomRadius();
+	const float cutoff = GetBondCutoff(cs);
+	Array<uint32_t> bonds;
+	for (unsigned k = 0; k < changed.GetSize(); k++)
+	{
+		unsigned i = changed[k];
+		const StoredAtom &a = cs.store.Get(i);
+		cs.grid.Move(i, a.GetPos());
+		GetAtomRecord(cs, i) = MakeAtomInstance(a.GetPos(), a.removed ? 0 : radius, a.species);
+		ForEachBond(cs, i, [&](unsigned b){ bonds.PushBack(b); });
+	}
+
+	BondEndpoints endpoints;
+	for (unsigned k = 0; k < bonds.GetSize(); k++)
+	{
+		const BondPair &b = GetBond(cs, bonds[k]);
+		Vector3f p0 = cs.store.Get(b.a).GetPos(), p1 = cs.store.Get(b.b).GetPos();
+		endpoints.X0.PushBack(p0.x); endpoints.Y0.PushBack(p0.y); endpoints.Z0.PushBack(p0.z);
+		endpoints.X1.PushBack(p1.x); endpoints.Y1.PushBack(p1.y); endpoints.Z1.PushBack(p1.z);
+	}
+
+	// Bonds of changed atoms follow their ends, and vanish with either or
+	// when stretched past the cutoff.
+	Array<BondInstance> inst;
+	inst.Resize(bonds.GetSize());
+	if (bonds.GetSize())
+		ComputeBondInstances(endpoints, bondRadius, bondColor, &inst[0]);
+	for (unsigned k = 0; k < bonds.GetSize(); k++)
+	{
+		const BondPair &b = GetBond(cs, bonds[k]);
+		BondInstance &r = GetBondRecord(cs, bonds[k]);
+		r = inst[k];
+		if (cs.store.Get(b.a).removed || cs.store.Get(b.b).removed || cutoff <= 2 * inst[k].HalfLength)
+			r.Radius = 0;
+	}
+}
+
+bool SceneBuilder::InjectDefects(const PointDefect *defects, unsigned count)
+{
+	CrystalScene &cs = *current;
+	if (!PrepareEdits(cs))
+		return false;
+
+	const float cutoff = GetBondCutoff(cs);
+	Array<uint32_t> changed, neighbors;
+	for (unsigned k = 0; k < count; k++)
+	{
+		const PointDefect &d = defects[k];
+		unsigned i = d.atom;
+		if (d.type == PointDefect::Interstitial)
+		{
+			// A slot that is empty in every version, filled by this step.
+			i = cs.store.Append();
+			cs.addedBondHead.PushBack(noBond);
+			cs.grid.Insert(i, d.pos);
+			AddRecords<AtomInstance>(*cs.addedAtomModel, 1);
+			AddToBounds(*cs.addedAtomModel, d.pos, cs.addedAtomModel->InstanceSize * 0.5f * maxSpeciesRadius);
+		}
+		else if (cs.store.GetSize() <= i)
+			continue;
+
+		StoredAtom a = cs.store.Get(i);
+		switch (d.type)
+		{
+		case PointDefect::Vacancy:
+			a.removed = 1;
+			break;
+		case PointDefect::Substitution:
+			a.species = d.species;
+			break;
+		case PointDefect::Interstitial:
+			a.removed = 0;
+			a.species = d.species;
+			// Fall through
+		case PointDefect::Displacement:
+			a.x = d.pos.x;
+			a.y = d.pos.y;
+			a.z = d.pos.z;
+			cs.grid.Move(i, d.pos);
+			break;
+		}
+		cs.store.Set(i, a);
+		changed.PushBack(i);
+
+		// Bond a moved or added atom to new neighbors, unless the scene has
+		// no bonds. Bonds are never deleted, so that undo needs no search;
+		// PatchAtoms() hides those stretched too far.
+		if (cs.detail.bonds && (d.type == PointDefect::Interstitial || d.type == PointDefect::Displacement))
+		{
+			neighbors.Clear();
+			cs.grid.FindNear(d.pos, cutoff, neighbors);
+			for (unsigned n = 0; n < neighbors.GetSize(); n++)
+			{
+				uint32_t j = neighbors[n];
+				bool bonded = j == i;
+				ForEachBond(cs, i, [&](unsigned b){
+					const BondPair &p = GetBond(cs, b);
+					bonded |= p.a == j || p.b == j;
+				});
+				if (!bonded)
+					AddBond(cs, i, j);
+			}
+		}
+	}
+	cs.store.Commit();
+	PatchAtoms(cs, changed);
+	return true;
+}
+
+void SceneBuilder::EditAtom(AtomEdit edit)
+{
+	CrystalScene &cs = *current;
+	if (!PrepareEdits(cs))
+		return;
+	int i = PickAtom(cs);
+	if (i < 0)
+		return;
+
+	const StoredAtom &a = cs.store.Get(i);
+	PointDefect d(PointDefect::Vacancy, i);
+	switch (edit)
+	{
+	case Edit_Remove:
+		break;
+	case Edit_Substitute:
+		d.type = PointDefect::Substitution;
+		d.species = uint16_t((a.species + 1) % speciesCount);
+		break;
+	case Edit_Push:
+		d.type = PointDefect::Displacement;
+		d.pos = a.GetPos() + viewDir * pushDistance;
+		break;
+	}
+	InjectDefects(&d, 1);
+}
+
+// A xorshift generator, so that scattered defects are the same on every run.
+static uint32_t NextRandom(uint32_t &state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+void SceneBuilder::ScatterDefects(unsigned count)
+{
+	CrystalScene &cs = *current;
+	if (!PrepareEdits(cs) || cs.bonds.GetSize() == 0)
+		return;
+
+	// Equal numbers of vacancies, substitutions and interstitials at the
+	// middle of bonds, among the atoms shown.
+	static uint32_t state = 2463534242u;
+	Array<PointDefect> defects;
+	for (unsigned tries = 0; defects.GetSize() < count && tries < 4 * count; tries++)
+	{
+		const BondPair &b = cs.bonds[NextRandom(state) % cs.bonds.GetSize()];
+		if (GetAtomShell(cs, b.a) >= cs.params.cells || GetAtomShell(cs, b.b) >= cs.params.cells)
+			continue;
+		switch (defects.GetSize() % 3)
+		{
+		case 0:
+			defects.PushBack(PointDefect(PointDefect::Vacancy, b.a));
+			break;
+		case 1:
+			defects.PushBack(PointDefect(PointDefect::Substitution, b.a, Vector3f(0),
+				uint16_t(1 + NextRandom(state) % (speciesCount - 1))));
+			break;
+		case 2:
+			defects.PushBack(PointDefect(PointDefect::Interstitial, 0,
+				(cs.store.Get(b.a).GetPos() + cs.store.Get(b.b).GetPos()) * 0.5f));
+			break;
+		}
+	}
+	if (defects.GetSize())
+		InjectDefects(&defects[0], defects.GetSize());
+}
 
-	int cells = structure == Diamond ? 6 : 3;
+void SceneBuilder::Undo()
+{
+	Array<uint32_t> changed;
+	if (current->addedAtomModel && current->store.Undo(changed))
+		PatchAtoms(*current, changed);
+}
 
-	for (int ix = -cells; ix < cells; ix++)
+void SceneBuilder::Redo()
+{
+	Array<uint32_t> changed;
+	if (current->addedAtomModel && current->store.Redo(changed))
+		PatchAtoms(*current, changed);
+}
+
+// Returns the one Model made by batch, or NULL.
+static Model *BuildBlockMesh(StaticBatch &batch, Container &temp)
+{
+	temp.Clear();
+	if (batch.Build(temp) == 0)
+		return NULL;
+	OVR_ASSERT(temp.Nodes.GetSize() == 1);
+	return (Model*)temp.Nodes[0].GetPtr();
+}
+
+// Makes bonds of a block from the batches of their cylinders and lines.
+static void BuildBlockBonds(StaticBatch &cylinders, StaticBatch &lines, unsigned needs, ShaderFill *fill,
+	Container &temp, BlockBonds &bonds)
+{
+	bonds.cylinders = BuildBlockMesh(cylinders, temp);
+	bonds.lines = BuildBlockMesh(lines, temp);
+	bonds.needs = needs;
+	if (bonds.cylinders)
 	{
-		for (int iy = -cells; iy < cells; iy++)
+		bonds.model = *new InstancedModel(bonds.cylinders, sizeof(BlockInstance));
+		bonds.model->Fill = fill;
+	}
+}
+
+void SceneBuilder::BuildSupercell(const SceneParams &params, CrystalScene &cs) const
+{
+	const LatticeDesc &lattice = GetLatticeDesc(params.structure);
+	const int n = cs.blockCells = GetSupercellBlockCells(cs.params.cells);
+	const float radius = params.GetAtomRadius();
+
+	// The block with a layer of cells around it, so that bonds to the
+	// neighboring blocks are found too.
+	AtomArrays atoms;
+	GenerateLatticeRange(lattice, -1, -1, -1, n + 2, n + 2, n + 2, atoms);
+	Array<BondPair> bonds;
+	if (cs.detail.bonds)
+		FindBonds(atoms, NearestNeighborDistance(lattice) * bondCutoff, bonds);
+
+	// An atom or bond belongs to the block containing its middle, so blocks
+	// tile without doubles. The tolerance puts points on a block face
+	// consistently on the side of the higher block.
+	auto toBlock = [&](const Vector3f &p){
+		return lattice.ToFractional(p) + Vector3f(1e-3f);
+	};
+	auto inBlock = [&](const Vector3f &p){
+		Vector3f f = toBlock(p);
+		return 0 <= f.x && f.x < n && 0 <= f.y && f.y < n && 0 <= f.z && f.z < n;
+	};
+	// The neighbors of the block p is in, as bits of CrystalScene::blockNeighbors.
+	auto neighborsOf = [&](const Vector3f &p){
+		Vector3f f = toBlock(p);
+		const float c[3] = {f.x, f.y, f.z};
+		unsigned bits = 0;
+		for (int axis = 0; axis < 3; axis++)
+			bits |= (c[axis] < 0 ? 1u : n <= c[axis] ? 2u : 0u) << 2 * axis;
+		return bits;
+	};
+
+	// The whole block is one chunk of each batch.
+	StaticBatch atomBatch(0);
+	const Model *sphere = atomLevels[cs.detail.atomLevel].Mesh;
+	for (unsigned i = 0; i < atoms.GetSize(); i++)
+		if (inBlock(atoms.GetPos(i)))
 		{
-			for (int iz = -cells; iz < cells; iz++)
+			float r = GetSpeciesRadius(radius, atoms.species[i]);
+			atomBatch.Add(sphere, bakedFill, Matrix4f::Translation(atoms.GetPos(i)) * Matrix4f::Scaling(r),
+				speciesColors[atoms.species[i] % speciesCount]);
+		}
+
+	BondEndpoints endpoints;
+	Array<unsigned> needs;
+	for (unsigned i = 0; i < bonds.GetSize(); i++)
+	{
+		Vector3f p0 = atoms.GetPos(bonds[i].a), p1 = atoms.GetPos(bonds[i].b);
+		if (!inBlock((p0 + p1) * 0.5f))
+			continue;
+		endpoints.X0.PushBack(p0.x); endpoints.Y0.PushBack(p0.y); endpoints.Z0.PushBack(p0.z);
+		endpoints.X1.PushBack(p1.x); endpoints.Y1.PushBack(p1.y); endpoints.Z1.PushBack(p1.z);
+		needs.PushBack(neighborsOf(p0) | neighborsOf(p1));
+	}
+	Array<BondInstance> bondInstances;
+	bondInstances.Resize(endpoints.GetSize());
+	if (endpoints.GetSize())
+		ComputeBondInstances(endpoints, bondRadius, bondColor, &bondInstances[0]);
+	Array<Matrix4f> xforms;
+	for (unsigned i = 0; i < bondInstances.GetSize(); i++)
+	{
+		const BondInstance &b = bondInstances[i];
+		xforms.PushBack(Matrix4f::Translation(b.Pos) * Matrix4f(b.Rot)
+			* Matrix4f::Scaling(Vector3f(b.Radius, b.Radius, b.HalfLength)));
+	}
+
+	// Bonds are made both as cylinders and as one line list, which
+	// LayoutBlocks() picks between: every bond, then those of the blocks on
+	// the faces, by the neighbors they need.
+	Container temp;
+	const Model *cylinder = bondLevels[cs.detail.bondLevel].Mesh, *line = bondLevels.Back().Mesh;
+	for (unsigned m = 0; m <= allBlockNeighbors + 1; m++)
+	{
+		const bool every = m > allBlockNeighbors;
+		StaticBatch cylinders(0), lines(0);
+		for (unsigned i = 0; i < bondInstances.GetSize(); i++)
+			if (every || needs[i] == m)
 			{
-				switch (structure)
-				{
-				default:
-				case Cube:
-					if(drawAtom)
-						add(ix, iy, iz);
-					if(drawBond){
-						if(-cells <= ix - 1)
-							addBond(Vector3f(ix - 1, iy, iz), Vector3f(ix, iy, iz));
-						if(-cells <= iy - 1)
-							addBond(Vector3f(ix, iy - 1, iz), Vector3f(ix, iy, iz));
-						if(-cells <= iz - 1)
-							addBond(Vector3f(ix, iy, iz - 1), Vector3f(ix, iy, iz));
-					}
-					break;
-				case FCC:
-					{
-						auto positioner = [&](int ix, int iy, int iz){
-							float xmod = (ix + cells + iy + cells + iz + cells) % 2 * sqrt(0.5f);
-							return Vector3f(ix * sqrt(0.5f) + xmod, iy * sqrt(0.5f), iz * sqrt(0.5f));
-						};
-						if(drawAtom)
-							addv(positioner(ix, iy, iz));
-						if(drawBond){
-							if(-cells <= iy - 1)
-								addBond(positioner(ix, iy - 1, iz), positioner(ix, iy, iz));
-							if(-cells <= iz - 1)
-								addBond(positioner(ix, iy, iz - 1), positioner(ix, iy, iz));
-							if(-cells <= iz - 1 && -cells <= iy - 1)
-								addBond(positioner(ix, iy - 1, iz - 1), positioner(ix, iy, iz));
-							if (-cells <= iz - 1 && iy + 1 < cells)
-								addBond(positioner(ix, iy + 1, iz - 1), positioner(ix, iy, iz));
-						}
-						break;
-					}
-				case BCC:
-					{
-						auto bccPositioner = [&](int ix, int iy, int iz){
-							float ymod = (iy + cells) % 2 * 0.5f;
-							return Vector3f(ix + ymod, float(iy * sqrt(1. / 2.)), iz + ymod);
-						};
-						if(drawAtom)
-							addv(bccPositioner(ix, iy, iz));
-						if (drawBond){
-							if (-cells <= iy - 1){
-								int ymod = (iy + cells) % 2;
-//								if (-cells <= ix + ymod - 1 && ix + ymod - 1 < cells)
-									addBond(bccPositioner(ix, iy - 1, iz), bccPositioner(ix, iy, iz));
-								if (-cells <= ix + ymod && ix + ymod < cells)
-									addBond(bccPositioner(ix + ymod, iy - 1, iz), bccPositioner(ix, iy, iz));
-								if (-cells <= iz + ymod && iz + ymod < cells)
-									addBond(bccPositioner(ix, iy - 1, iz + ymod), bccPositioner(ix, iy, iz));
-								if (-cells <= ix + ymod && ix + ymod < cells && -cells <= iz + ymod && iz + ymod < cells)
-									addBond(bccPositioner(ix + ymod, iy - 1, iz + ymod), bccPositioner(ix, iy, iz));
-							}
-						}
-						break;
-					}
-				case Diamond:
-					{
-						int xmod = (ix + cells) % 2;
-						int ymod = (iy + cells) % 2;
-						int zmod = (iz + cells) % 2;
-						int xyzmod = (ix + cells + iy + cells + iz + cells) % 4;
-						float fh = sqrt(1.f / 3.f);
-						if (drawAtom){
-							if (xmod == ymod && ymod == zmod && (xyzmod == 0 || xyzmod == 1))
-								add(ix * fh, iy * fh, iz * fh);
-						}
-						break;
-					}
-				}
+				cylinders.Add(cylinder, bakedFill, xforms[i], bondInstances[i].C);
+				lines.Add(line, bakedFill, xforms[i], bondInstances[i].C);
 			}
+		BlockBonds b;
+		BuildBlockBonds(cylinders, lines, every ? 0 : m, blockFill, temp, b);
+		if (!b.model)
+			continue;
+		cs.bondNode->Add(b.model);
+		if (every)
+			cs.bondBlocks = b;
+		else
+			cs.faceBonds.PushBack(b);
+	}
+
+	Model *atomMesh = BuildBlockMesh(atomBatch, temp);
+	if (atomMesh)
+	{
+		cs.atomBlocks = *new InstancedModel(atomMesh, sizeof(BlockInstance));
+		cs.atomBlocks->Fill = blockFill;
+		cs.atomNode->Add(cs.atomBlocks);
+	}
+
+	// Blocks are culled by the sphere around both meshes.
+	cs.blockCenter = lattice.ToCartesian(n * 0.5f, n * 0.5f, n * 0.5f);
+	cs.blockRadius = 0;
+	for (int m = 0; m < 2; m++)
+	{
+		const Model *mesh = m ? cs.bondBlocks.cylinders.GetPtr() : atomMesh;
+		for (unsigned v = 0; mesh && v < mesh->Vertices.GetSize(); v++)
+			cs.blockRadius = max(cs.blockRadius, (mesh->Vertices[v].Pos - cs.blockCenter).Length());
+	}
+}
+
+void SceneBuilder::LayoutBlocks(CrystalScene &cs)
+{
+	const LatticeDesc &lattice = GetLatticeDesc(cs.params.structure);
+	const int n = cs.blockCells, cells = cs.params.cells;
+	const int count = 2 * cells / n;
+	cs.blocks.Clear();
+	cs.blockNeighbors.Clear();
+	for (int bz = 0; bz < count; bz++)
+	for (int by = 0; by < count; by++)
+	for (int bx = 0; bx < count; bx++)
+	{
+		cs.blocks.PushBack(lattice.ToCartesian(float(bx * n - cells), float(by * n - cells), float(bz * n - cells)));
+		const int b[3] = {bx, by, bz};
+		uint8_t bits = 0;
+		for (int axis = 0; axis < 3; axis++)
+			bits |= (0 < b[axis] ? 1 : 0) << 2 * axis | (b[axis] + 1 < count ? 2 : 0) << 2 * axis;
+		cs.blockNeighbors.PushBack(bits);
+	}
+
+	if (cs.bondBlocks.model)
+	{
+		size_t bondCount = cs.blocks.GetSize() * (cs.bondBlocks.lines->Indices.GetSize() / 2);
+		const bool lines = bondCount > maxCylinderBonds;
+		for (unsigned i = 0; i <= cs.faceBonds.GetSize(); i++)
+		{
+			BlockBonds &b = i < cs.faceBonds.GetSize() ? cs.faceBonds[i] : cs.bondBlocks;
+			b.model->Mesh = lines ? b.lines : b.cylinders;
 		}
 	}
+}
+
+void ViewFrustum::Set(const Vector3f &eye, const Matrix4f &orientation, float upTan, float downTan, float leftTan, float rightTan)
+{
+	this->eye = eye;
+	// Looking down -z, a point at depth -z is inside while x is within
+	// [-leftTan, rightTan] times that, and y within [-downTan, upTan].
+	const Vector3f sides[4] = {
+		Vector3f(1, 0, -leftTan), Vector3f(-1, 0, -rightTan), Vector3f(0, 1, -downTan), Vector3f(0, -1, -upTan),
+	};
+	for (int i = 0; i < 4; i++)
+		normals[i] = orientation.Transform(sides[i].Normalized());
+}
+
+// Sets the instance records of model to those of blocks, uploading them again
+// only if they changed.
+static void SetBlockInstances(InstancedModel *model, const Array<BlockInstance> &blocks)
+{
+	unsigned count = blocks.GetSize();
+	if (!model || (model->GetInstanceCount() == count
+		&& (count == 0 || !memcmp(model->GetInstances<BlockInstance>(), &blocks[0], count * sizeof(BlockInstance)))))
+		return;
+	BlockInstance *inst = model->ResizeInstances<BlockInstance>(count);
+	if (count)
+		memcpy(inst, &blocks[0], count * sizeof(BlockInstance));
+}
+
+void SceneBuilder::CullBlocks(CrystalScene &cs) const
+{
+	// Whole blocks out of view of both eyes are left out of the instance
+	// records. Blocks inside the crystal draw all their bonds at once, and
+	// those on its faces the bonds of each neighbor they have.
+	Array<BlockInstance> visible, inner, face;
+	Array<unsigned> onFace;
+	for (unsigned i = 0; i < cs.blocks.GetSize(); i++)
+	{
+		Vector3f center = cs.blocks[i] + cs.blockCenter;
+		if (!eyes[0].Intersects(center, cs.blockRadius) && !eyes[1].Intersects(center, cs.blockRadius))
+			continue;
+		BlockInstance b;
+		b.Offset = cs.blocks[i];
+		visible.PushBack(b);
+		if (cs.blockNeighbors[i] == allBlockNeighbors)
+			inner.PushBack(b);
+		else
+			onFace.PushBack(i);
+	}
+
+	SetBlockInstances(cs.atomBlocks, visible);
+	SetBlockInstances(cs.bondBlocks.model, inner);
+	for (unsigned f = 0; f < cs.faceBonds.GetSize(); f++)
+	{
+		const unsigned needs = cs.faceBonds[f].needs;
+		face.Clear();
+		for (unsigned k = 0; k < onFace.GetSize(); k++)
+			if ((cs.blockNeighbors[onFace[k]] & needs) == needs)
+			{
+				BlockInstance b;
+				b.Offset = cs.blocks[onFace[k]];
+				face.PushBack(b);
+			}
+		SetBlockInstances(cs.faceBonds[f].model, face);
+	}
+}
+
+// Makes the nodes of one streamed chunk; runs on the stream thread.
+void SceneBuilder::BuildChunkNodes(const SceneParams &params, const AtomArrays &atoms, unsigned coreCount,
+	const Array<BondPair> &bonds, Ptr<Node> &atomNode, Ptr<Node> &bondNode) const
+{
+	const float radius = params.GetAtomRadius();
+	if (coreCount)
+	{
+		Ptr<LodInstancedModel> model = *new LodInstancedModel(atomLevels, sizeof(AtomInstance));
+		AtomInstance *inst = model->ResizeInstances<AtomInstance>(coreCount);
+		for (unsigned i = 0; i < coreCount; i++)
+			inst[i] = MakeAtomInstance(atoms.GetPos(i), radius, atoms.species[i]);
+		SetLodBounds<AtomInstance>(model, radius * maxSpeciesRadius, 2 * radius);
+		model->Fill = atomFill;
+		atomNode = model;
+	}
+
+	if (bonds.GetSize())
+	{
+		BondEndpoints endpoints;
+		endpoints.Gather(atoms, bonds);
+		Ptr<LodInstancedModel> model = *new LodInstancedModel(bondLevels, sizeof(BondInstance));
+		ComputeBondInstances(endpoints, bondRadius, bondColor, model->ResizeInstances<BondInstance>(endpoints.GetSize()));
+		float halfLength = NearestNeighborDistance(GetLatticeDesc(params.structure)) * 0.55f;
+		SetLodBounds<BondInstance>(model, halfLength + bondRadius, 2 * bondRadius);
+		model->Fill = bondFill;
+		bondNode = model;
+	}
+}
+
+// Returns the hash of everything a SceneFile saved for params depends on.
+uint64_t SceneBuilder::HashSceneFile(const SceneParams &params) const
+{
+	const LatticeDesc &lattice = GetLatticeDesc(params.structure);
+	SceneHash h;
+	h.Add(lattice.a);
+	h.Add(lattice.b);
+	h.Add(lattice.c);
+	for (int i = 0; i < lattice.basisCount; i++)
+	{
+		// Field by field, as the padding of a BasisAtom is undefined.
+		h.Add(lattice.basis[i].x);
+		h.Add(lattice.basis[i].y);
+		h.Add(lattice.basis[i].z);
+		h.Add(lattice.basis[i].species);
+	}
+	h.Add(params.GetCells());
+	h.Add(bondCutoff);
+	SceneDetail detail = Govern(params);
+	h.Add(detail.bonds);
+	h.Add(params.bakeStatic);
+	h.Add(params.IsPolycrystal());
+	if (params.IsPolycrystal())
+	{
+		h.Add(grainSize);
+		h.Add(grainOverlap);
+		h.Add(grainSeed);
+	}
+	if (params.bakeStatic)
+	{
+		h.Add(params.scale);
+		h.Add(speciesColors);
+		h.Add(speciesRadii);
+		h.Add(bondRadius);
+		h.Add(bondColor);
+		h.Add(atomLevels[detail.atomLevel].Mesh->Vertices.GetSize());
+		h.Add(bondLevels[detail.bondLevel].Mesh->Vertices.GetSize());
+		h.Add(maxCylinderBonds);
+	}
+	return h.Get();
+}
+
+// Creates the GPU-side resources every build shares, on the render thread.
+void SceneBuilder::Init(RenderDevice* render)
+{
+	FillCollection fills(render);
+	atomFill = fills.AtomInstanced;
+	bondFill = fills.BondInstanced;
+	blockFill = fills.BlockInstanced;
+	bakedFill = fills.LitTextures[Tex_Checker];
+
+	for (int i = 0; i < int(sizeof(sphereLods) / sizeof(sphereLods[0])); i++)
+	{
+		LodInstancedModel::Level level;
+		level.Mesh = meshes.Get(Mesh_Sphere, sphereLods[i].slices, sphereLods[i].stacks);
+		level.MinPixels = sphereLods[i].minPixels;
+		atomLevels.PushBack(level);
+	}
+	for (int i = 0; i < int(sizeof(cylinderLods) / sizeof(cylinderLods[0])); i++)
+	{
+		LodInstancedModel::Level level;
+		level.Mesh = cylinderLods[i].segments ? meshes.Get(Mesh_Cylinder, cylinderLods[i].segments, 1)
+			: meshes.Get(Mesh_Line, 0, 0);
+		level.MinPixels = cylinderLods[i].minPixels;
+		bondLevels.PushBack(level);
+	}
+
+	// The first scene is built before anything is shown, so do it here,
+	// loading the file saved by an earlier run if it has the same parameters.
+	current = new CrystalScene;
+	char path[MAX_PATH];
+	uint64_t hash = HashSceneFile(*this);
+	bool havePath = !stream && !supercell && SceneFile::GetDefaultPath(path, sizeof(path));
+	SceneFile file;
+	bool loaded = havePath && file.Open(path, hash);
+	PopulateRoomScene(*this, *current, loaded ? &file : NULL);
+	file.Close();
+	if (havePath && !loaded)
+		SceneFile::Write(path, hash, current->atoms, current->bonds,
+			bakeStatic ? current->atomNode : NULL, bakeStatic ? current->bondNode : NULL);
+	latest = current;
+	latestParams = *this;
+	latestCells = current->generatedCells;
 
-    scene->SetAmbient(Vector4f(0.65f,0.65f,0.65f,1));
-	scene->Lighting.LightCount = 0;
-    scene->AddLight(Vector3f(-2,4,-2), Vector4f(8,8,8,1));
-    scene->AddLight(Vector3f(3,4,-3),  Vector4f(2,1,1,1));
-    scene->AddLight(Vector3f(-4,3,25), Vector4f(3,6,3,1));
+	thread = std::thread(&SceneBuilder::BuildThread, this);
 }
@@ -2,30 +2,317 @@
 #define OCULUSTEST_H
 
 #include "RenderTiny_D3D11_Device.h"
-
-enum CrystalStructure
-{
-	Cube,
-	FCC, // Face Centered Cubic
-	BCC, // Body Centered Cubic
-	Diamond,
-	Num_CrystalStructure
-};
+#include "CrystalLattice.h"
+#include "MeshCache.h"
+#include "SceneArena.h"
+#include "LatticeStream.h"
+#include "SceneFile.h"
+#include "AtomStore.h"
+#include "NeighborGrid.h"
+#include "BondGraph.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 /// Parameters to PopulateRoomScene()
-struct SceneBuilder{
+struct SceneParams{
 	CrystalStructure structure;
 	double scale;
+	int cells; ///< Half extent of the crystal in unit cells, or 0 for the structure's default
 	bool drawAtom;
 	bool drawBond;
-	SceneBuilder() : structure(Cube), scale(0.5),
-		drawAtom(true), drawBond(true){}
+	bool bakeStatic; ///< Merge atoms and bonds into chunked meshes instead of instancing
+	bool stream; ///< Generate an unbounded lattice in chunks around the viewer; implies instancing
+	bool supercell; ///< Draw one baked block of unit cells repeatedly instead of every atom; ignored if stream
+	bool polycrystal; ///< Fill the extent with randomly oriented grains; ignored if stream or supercell
+
+	SceneParams() : structure(Cube), scale(0.5), cells(0),
+		drawAtom(true), drawBond(true), bakeStatic(false), stream(false), supercell(false), polycrystal(false){}
+
+	float GetAtomRadius() const { return float(0.5 * scale); }
+	int GetCells() const { return cells ? cells : GetLatticeDesc(structure).cells; }
+	bool IsPolycrystal() const { return polycrystal && !stream && !supercell; }
+};
+
+/// An instanced chunk whose records are sorted by lattice shell (see
+/// LatticeShell()), so that any smaller extent draws a prefix of them.
+struct ExtentChunk{
+	LodInstancedModel *model; ///< Owned by the scene's atomNode or bondNode
+	int firstShell;
+	Array<uint32_t> ends; ///< ends[i] is the number of records in shells up to firstShell + i
+
+	/// Returns the number of records to draw for a crystal of the given cells.
+	unsigned GetCount(int cells) const{
+		int i = cells - 1 - firstShell;
+		if (i < 0)
+			return 0;
+		return ends[i < int(ends.GetSize()) ? i : ends.GetSize() - 1];
+	}
+};
+
+/// Chunks of one shell that the build thread grew onto a CrystalScene.
+struct CrystalShell : public NewOverrideBase{
+	unsigned serial; ///< CrystalScene::serial of the scene grown
+	int shell;
+	Ptr<Container> atomNode, bondNode;
+	Array<ExtentChunk> extentChunks;
+};
+
+/// A point defect, or another change to one atom; see SceneBuilder::InjectDefects().
+struct PointDefect{
+	enum Type{
+		Vacancy,      ///< Removes atom
+		Substitution, ///< Changes atom to species
+		Interstitial, ///< Adds an atom of species at pos
+		Displacement, ///< Moves atom to pos
+	};
+	Type type;
+	uint32_t atom;
+	Vector3f pos;
+	uint16_t species;
+
+	PointDefect(Type type = Vacancy, uint32_t atom = 0, const Vector3f &pos = Vector3f(0), uint16_t species = 0)
+		: type(type), atom(atom), pos(pos), species(species){}
+};
+
+/// The four side planes of the view frustum of an eye, which has no near or
+/// far plane for culling.
+struct ViewFrustum{
+	Vector3f eye;
+	Vector3f normals[4]; ///< Pointing inward; zero, so that everything is inside, until Set()
+
+	/// Sets the frustum of an eye at eye rotated by orientation from looking
+	/// down -z, whose sides are at the given tangents of the view direction.
+	void Set(const Vector3f &eye, const Matrix4f &orientation, float upTan, float downTan, float leftTan, float rightTan);
+	/// Whether any of the sphere at center with radius r is inside.
+	bool Intersects(const Vector3f &center, float r) const
+	{
+		for (int i = 0; i < 4; i++)
+			if (normals[i].Dot(center - eye) < -r)
+				return false;
+		return true;
+	}
+};
+
+/// How finely a scene is drawn, which SceneBuilder::Govern() coarsens from the
+/// finest until the scene fits the budgets, along with the size it estimated.
+struct SceneDetail{
+	int atomLevel; ///< Finest of SceneBuilder::atomLevels drawn, or the one baked
+	int bondLevel; ///< Same for SceneBuilder::bondLevels, whose last is lines
+	bool bonds; ///< Whether bonds are made at all
+	uint64_t triangles; ///< Triangles drawn when every atom and bond is at the finest level
+	uint64_t bytes; ///< Vertex, index and instance buffers, counting GPU copies
+
+	SceneDetail() : atomLevel(0), bondLevel(0), bonds(true), triangles(0), bytes(0){}
+	/// Whether the same nodes are made for both, whatever the estimates.
+	bool operator==(const SceneDetail &d) const { return atomLevel == d.atomLevel && bondLevel == d.bondLevel && bonds == d.bonds; }
+	bool operator!=(const SceneDetail &d) const { return !(*this == d); }
+};
+
+/// Bonds of a supercell block drawn by one InstancedModel, whose mesh is either
+/// their cylinders or their lines.
+struct BlockBonds{
+	Ptr<InstancedModel> model; ///< NULL if there are no such bonds
+	Ptr<Model> cylinders, lines;
+	unsigned needs; ///< Neighbors of the block the bonds reach into, as in CrystalScene::blockNeighbors
+
+	BlockBonds() : needs(0){}
+};
+
+/// A crystal built by PopulateRoomScene(): the atoms, their bonds and the
+/// scene nodes that display them.
+struct CrystalScene : public NewOverrideBase{
+	SceneArena arena; ///< Instance records of the nodes; declared first so it outlives them
+	Scene scene;
+	SceneParams params; ///< Parameters the nodes currently reflect
+	SceneDetail detail; ///< Chosen for the extent the scene was built with
+	AtomArrays atoms; ///< Atoms of the initial extent; grown shells only have nodes
+	Array<BondPair> bonds; ///< In bond order (see SortBonds())
+	Ptr<Container> atomNode, bondNode; ///< LodInstancedModel chunks, or baked meshes
+	Array<ExtentChunk> extentChunks; ///< Every instanced chunk unless streaming
+	int generatedCells; ///< Extent the chunks have records for; params.cells is the one drawn
+	LatticeStream *stream; ///< Fills atomNode and bondNode if params.stream
+	unsigned serial; ///< Unique among the scenes built
+	int baseCells; ///< Extent atoms was generated for
+
+	/// Edited copy of atoms, made by the first edit.
+	AtomStore store;
+	/// Instance records of the atoms and bonds in the arena, and the record of
+	/// each atom and bond; NULL unless instanced.
+	AtomInstance *atomRecords;
+	uint32_t *atomSlots;
+	BondInstance *bondRecords;
+	uint32_t *bondSlots;
+	/// The neighbors and bonds of each of atoms; made by the first edit.
+	BondGraph graph;
+	NeighborGrid grid; ///< Positions of the stored atoms, made by the first edit
+	/// Bonds made by edits, numbered after bonds. Those of atom i are a list
+	/// starting at addedBondHead[i], where the one after addedBonds[j] is
+	/// addedBondNext[2 * j] if i is its a, else addedBondNext[2 * j + 1].
+	Array<BondPair> addedBonds;
+	Array<uint32_t> addedBondHead, addedBondNext;
+	/// Records of atoms and bonds added by edits, numbered after atoms and
+	/// bonds; made by the first edit.
+	Ptr<LodInstancedModel> addedAtomModel, addedBondModel;
+	Array<InstancedModel*> editModels; ///< extentChunks ordered by the address of their records
+
+	/// One block of blockCells unit cells drawn translated to each of blocks
+	/// that is in view, if params.supercell. A block lacking a neighbor on a
+	/// face of the crystal leaves out the bonds that reach into it, so it
+	/// draws its bonds from faceBonds, split by the neighbors they need.
+	int blockCells; ///< Divides the extent, so that blocks fill it exactly; 0 unless params.supercell
+	Ptr<InstancedModel> atomBlocks;
+	BlockBonds bondBlocks; ///< Every bond of the block, for blocks with all six neighbors
+	Array<BlockBonds> faceBonds;
+	Array<Vector3f> blocks;
+	/// Bit 2 * axis is set for each of blocks that has a neighbor on the low
+	/// side along that lattice vector, and bit 2 * axis + 1 for the high side.
+	Array<uint8_t> blockNeighbors;
+	Vector3f blockCenter; ///< Bounding sphere of the block at offset zero
+	float blockRadius;
+
+	CrystalScene() : generatedCells(0), stream(NULL), serial(0), baseCells(0),
+		atomRecords(NULL), atomSlots(NULL), bondRecords(NULL), bondSlots(NULL), blockCells(0), blockRadius(0){}
+	~CrystalScene(){ delete stream; }
+
+	/// Whether atoms and bonds are instanced records rather than baked meshes.
+	bool IsInstanced() const { return stream || (!params.bakeStatic && !params.supercell); }
+	/// Whether this scene can show p, drawn with detail, after
+	/// SceneBuilder::Apply() and growing.
+	bool Serves(const SceneParams &p, const SceneDetail &detail) const;
+	/// Estimates the bytes held by this scene, counting GPU copies of its
+	/// meshes and instance records.
+	size_t GetMemoryUsage() const;
+};
+
+/// Owns the displayed CrystalScene and replaces it when the parameters change.
+/// Changes that only touch existing nodes are applied at once; anything that
+/// needs new geometry is built on a background thread into a second
+/// CrystalScene, which is swapped in by Update() at the start of a frame.
+/// Requests made while a build is pending are merged, so only the latest
+/// parameters are built. Growing an instanced crystal past the extent it was
+/// built with only builds the new shells, and shrinking it only draws fewer
+/// records of each chunk. Replaced scenes are kept in a least recently used
+/// cache up to cacheBudget bytes, and one that serves new parameters is
+/// swapped in at once instead of being built again. Before a build, Govern()
+/// estimates the size of the scene and coarsens it to fit triangleBudget and
+/// geometryBudget. After a build, its temporary storage is trimmed back to
+/// scratchBudget.
+struct SceneBuilder : SceneParams{
+	Ptr<ShaderFill> atomFill, bondFill, bakedFill, blockFill; ///< Created by Init()
+	MeshCache meshes;
+	/// Levels of detail, finest first, which baked atoms and bonds take one
+	/// unit mesh of.
+	Array<LodInstancedModel::Level> atomLevels, bondLevels;
+
+	size_t cacheBudget; ///< Bytes the cached scenes may hold
+	uint64_t triangleBudget; ///< Triangles a scene may draw when seen from close by
+	uint64_t geometryBudget; ///< Bytes of buffers a scene may hold
+	size_t scratchBudget; ///< Bytes of temporary build storage kept between builds
+
+	SceneBuilder() : cacheBudget(256 << 20), triangleBudget(4000000), geometryBudget(512 << 20),
+		scratchBudget(64 << 20), current(NULL), latest(NULL), latestCells(0),
+		growing(NULL), ready(NULL), requested(false), quit(false){}
 
 	void ToggleStructure();
 	void ResizeAtom(double d);
 	void ToggleDrawAtom();
 	void ToggleDrawBond();
-	void PopulateRoomScene(Scene* scene, RenderDevice* render);
+	void ToggleBakeStatic();
+	void ToggleStream();
+	void ToggleSupercell();
+	void TogglePolycrystal();
+	void ResizeExtent(int d);
+
+	enum AtomEdit{
+		Edit_Remove, ///< Delete the atom and its bonds
+		Edit_Substitute, ///< Change the atom to the next species
+		Edit_Push, ///< Move the atom away from the viewer
+	};
+	/// Edits the atom the viewer looks at, as one undoable step.
+	void EditAtom(AtomEdit edit);
+	/// Applies defects to the displayed crystal in order, as one undoable
+	/// step. Atoms moved or added are bonded to the atoms near them, and only
+	/// the records of changed atoms and their bonds are uploaded again.
+	/// Returns false if the crystal cannot be edited.
+	bool InjectDefects(const PointDefect *defects, unsigned count);
+	/// Injects count random vacancies, substitutions and interstitials.
+	void ScatterDefects(unsigned count);
+	void Undo();
+	void Redo();
+
+	/// Creates the shared resources, builds the first scene and starts the build thread.
+	void Init(RenderDevice* render);
+	/// Stops the build thread and frees every scene and shared resource.
+	void Release();
+	/// Swaps in a finished background build, if any, streams chunks around
+	/// viewPos, and returns the scene to render. viewDir is where EditAtom()
+	/// aims, and supercell blocks are drawn if they are in either of the two
+	/// frusta of eyes.
+	Scene* Update(const Vector3f &viewPos, const Vector3f &viewDir, const ViewFrustum *eyes);
+
+	/// Builds a complete crystal for params into cs, reading what file has
+	/// instead of generating it if given. Returns false if a newer request made
+	/// the build pointless before it finished.
+	bool PopulateRoomScene(const SceneParams &params, CrystalScene &cs, const SceneFile *file = NULL) const;
+	/// Estimates the triangles and buffers of the scene for params and returns
+	/// the finest detail that fits the budgets. Spheres and cylinders are
+	/// coarsened first, whichever draws more triangles, then bonds are drawn
+	/// as lines, then dropped. Streamed scenes are bounded by the stream
+	/// radius and always get the finest.
+	SceneDetail Govern(const SceneParams &params) const;
+
+protected:
+	void RequestRebuild();
+	void BuildThread();
+	bool Superseded() const;
+	uint64_t HashSceneFile(const SceneParams &params) const;
+	void Cache(CrystalScene *cs);
+	CrystalScene *TakeCached(const SceneParams &params, const SceneDetail &detail);
+	CrystalScene *FindScene(unsigned serial) const;
+	/// Updates the radius and visibility of cs to the current parameters,
+	/// checking every chunk if newChunks were added since the last call.
+	void Apply(CrystalScene &cs, bool newChunks = false);
+	void BuildAtoms(const SceneParams &params, CrystalScene &cs, const uint16_t *atomShells) const;
+	void BuildBonds(const SceneParams &params, CrystalScene &cs, const uint16_t *atomShells) const;
+	/// Returns the levels of atom chunks drawn with detail.
+	Array<LodInstancedModel::Level> GetAtomLevels(const SceneDetail &detail) const;
+	/// Returns the levels of bond chunks drawn with detail in an extent of bondCount bonds.
+	Array<LodInstancedModel::Level> GetBondLevels(const SceneDetail &detail, size_t bondCount) const;
+	/// Builds the chunks of shell k of cs, whose records are allocated from cs.arena.
+	void BuildShell(const SceneParams &params, int k, CrystalScene &cs, CrystalShell &shell) const;
+	/// Makes the store and bond index of cs on the first edit. Returns false if
+	/// cs cannot be edited.
+	bool PrepareEdits(CrystalScene &cs);
+	/// Returns the nearest shown atom on the view ray, or -1.
+	int PickAtom(const CrystalScene &cs) const;
+	/// Rewrites the records of the changed atoms and their bonds from the store.
+	void PatchAtoms(CrystalScene &cs, const Array<uint32_t> &changed);
+	/// Builds the block meshes of a supercell crystal.
+	void BuildSupercell(const SceneParams &params, CrystalScene &cs) const;
+	/// Places blocks over the extent of cs and picks the bond mesh for their number.
+	static void LayoutBlocks(CrystalScene &cs);
+	/// Draws only the blocks of cs that may be in view.
+	void CullBlocks(CrystalScene &cs) const;
+	void BuildChunkNodes(const SceneParams &params, const AtomArrays &atoms, unsigned coreCount,
+		const Array<BondPair> &bonds, Ptr<Node> &atomNode, Ptr<Node> &bondNode) const;
+
+	CrystalScene *current; ///< The displayed scene
+	Vector3f viewPos, viewDir; ///< Given to the last Update()
+	ViewFrustum eyes[2];
+	mutable SceneArena scratch; ///< Temporary storage of the build in progress
+	Array<CrystalScene*> cache; ///< Replaced scenes, least recently shown first
+	std::thread thread;
+	mutable std::mutex mutex; ///< Guards the members below
+	std::condition_variable wake;
+	CrystalScene *latest; ///< Scene the next request is measured against, ready or current
+	SceneParams latestParams; ///< What latest was built with
+	int latestCells; ///< Extent latest has chunks for, including shells not adopted yet
+	CrystalScene *growing; ///< Scene the build thread adds shells to, which must not be freed
+	SceneParams pending; ///< Latest parameters requested
+	CrystalScene *ready; ///< Finished build waiting for Update()
+	Array<CrystalShell*> readyShells; ///< Shells grown onto latest waiting for Update()
+	bool requested, quit;
 };
 
 extern SceneBuilder sbuilder;
@@ -0,0 +1,434 @@
+#include "Polycrystal.h"
+#include "NeighborGrid.h"
+#include "WorkerPool.h"
+#include <math.h>
+#include <stdlib.h>
+
+float GetPolycrystalCellSize(const LatticeDesc &lattice)
+{
+	float a = lattice.a.Length(), b = lattice.b.Length(), c = lattice.c.Length();
+	float longest = a < b ? b : a;
+	return longest < c ? c : longest;
+}
+
+int PolycrystalShell(float cellSize, int cells, const Vector3f &p)
+{
+	int s = LatticeShell(int(floor(p.x / cellSize)), int(floor(p.y / cellSize)), int(floor(p.z / cellSize)));
+	return s < cells ? s : cells - 1;
+}
+
+// xorshift32, scaled to [0, 1).
+static float NextUniform(uint32_t &state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return (state >> 8) * (1.f / 16777216.f);
+}
+
+/// The sample cut into a grid of boxes, each with every grain whose Voronoi
+/// cell may reach into it, followed by those that come within margin of it,
+/// so that the grains of the atoms near a point in the box are among them.
+class GrainGrid
+{
+public:
+	/// Cuts the cube of half extent half into boxes at least minBoxSize wide,
+	/// listing the grains that reach margin further too.
+	GrainGrid(const Array<Vector3f> &seeds, float half, float minBoxSize, float margin);
+
+	/// Returns the box p is in, or -1 outside the sample.
+	int BoxOf(const Vector3f &p) const;
+	void GetBox(int v, Vector3f &lo, Vector3f &hi) const;
+	unsigned GetCandidateCount(int v) const { return candidateStart[v + 1] - candidateStart[v]; }
+	const uint32_t *GetCandidates(int v) const { return &candidates[candidateStart[v]]; }
+	/// Boxes grain g may reach into are grainBoxes[grainStart[g]] up to grainStart[g + 1].
+	Array<uint32_t> grainStart, grainBoxes;
+
+protected:
+	/// Writes the grains listed for box v to out if it is given, and returns
+	/// their count; owners is set to the number that may reach into the box.
+	unsigned FindCandidates(int v, uint32_t *out, uint32_t &owners) const;
+
+	const Array<Vector3f> &seeds;
+	float half, boxSize, margin;
+	int n; ///< Boxes along each axis
+	Array<uint32_t> candidateStart, candidates, ownerCount;
+
+	/// Seeds bucketed into a coarser grid to find those near a point.
+	int bucketCount;
+	float bucketSize;
+	Array<uint32_t> bucketStart, bucketSeeds;
+};
+
+GrainGrid::GrainGrid(const Array<Vector3f> &seeds, float half, float minBoxSize, float margin)
+	: seeds(seeds), half(half), margin(margin)
+{
+	n = int(2 * half / minBoxSize);
+	n = n < 1 ? 1 : n;
+	boxSize = 2 * half / n;
+
+	// About one seed per bucket.
+	const unsigned grainCount = seeds.GetSize();
+	bucketCount = int(pow(double(grainCount), 1. / 3.));
+	bucketCount = bucketCount < 1 ? 1 : bucketCount;
+	bucketSize = 2 * half / bucketCount;
+	auto bucketOf = [&](const Vector3f &p){
+		int i[3];
+		for (int k = 0; k < 3; k++)
+		{
+			i[k] = int(floor((p[k] + half) / bucketSize));
+			i[k] = i[k] < 0 ? 0 : bucketCount <= i[k] ? bucketCount - 1 : i[k];
+		}
+		return (i[2] * bucketCount + i[1]) * bucketCount + i[0];
+	};
+	bucketStart.Resize(bucketCount * bucketCount * bucketCount + 1);
+	memset(&bucketStart[0], 0, bucketStart.GetSize() * sizeof(uint32_t));
+	for (unsigned g = 0; g < grainCount; g++)
+		bucketStart[bucketOf(seeds[g]) + 1]++;
+	for (unsigned b = 1; b < bucketStart.GetSize(); b++)
+		bucketStart[b] += bucketStart[b - 1];
+	Array<uint32_t> fill;
+	fill.Resize(bucketStart.GetSize() - 1);
+	memcpy(&fill[0], &bucketStart[0], fill.GetSize() * sizeof(uint32_t));
+	bucketSeeds.Resize(grainCount);
+	for (unsigned g = 0; g < grainCount; g++)
+		bucketSeeds[fill[bucketOf(seeds[g])]++] = g;
+
+	// Count, then list, the grains of each box.
+	const int boxCount = n * n * n;
+	WorkerPool &pool = WorkerPool::Shared();
+	candidateStart.Resize(boxCount + 1);
+	candidateStart[0] = 0;
+	ownerCount.Resize(boxCount);
+	pool.ParallelFor(boxCount, [&](int begin, int end){
+		for (int v = begin; v < end; v++)
+			candidateStart[v + 1] = FindCandidates(v, NULL, ownerCount[v]);
+	});
+	for (int v = 0; v < boxCount; v++)
+		candidateStart[v + 1] += candidateStart[v];
+	candidates.Resize(candidateStart[boxCount]);
+	pool.ParallelFor(boxCount, [&](int begin, int end){
+		for (int v = begin; v < end; v++)
+			FindCandidates(v, &candidates[candidateStart[v]], ownerCount[v]);
+	});
+
+	// The boxes of each grain, which are only those it may reach into.
+	grainStart.Resize(grainCount + 1);
+	memset(&grainStart[0], 0, grainStart.GetSize() * sizeof(uint32_t));
+	for (int v = 0; v < boxCount; v++)
+		for (uint32_t k = 0; k < ownerCount[v]; k++)
+			grainStart[candidates[candidateStart[v] + k] + 1]++;
+	for (unsigned g = 0; g < grainCount; g++)
+		grainStart[g + 1] += grainStart[g];
+	fill.Resize(grainCount);
+	memcpy(&fill[0], &grainStart[0], grainCount * sizeof(uint32_t));
+	grainBoxes.Resize(grainStart[grainCount]);
+	for (int v = 0; v < boxCount; v++)
+		for (uint32_t k = 0; k < ownerCount[v]; k++)
+			grainBoxes[fill[candidates[candidateStart[v] + k]]++] = v;
+}
+
+unsigned GrainGrid::FindCandidates(int v, uint32_t *out, uint32_t &owners) const
+{
+	Vector3f lo, hi;
+	GetBox(v, lo, hi);
+	const Vector3f c = (lo + hi) * 0.5f;
+	int b[3];
+	for (int k = 0; k < 3; k++)
+	{
+		b[k] = int(floor((c[k] + half) / bucketSize));
+		b[k] = b[k] < 0 ? 0 : bucketCount <= b[k] ? bucketCount - 1 : b[k];
+	}
+
+	// Calls f for the seeds in buckets at most r from b along every axis and,
+	// if ring is set, exactly r along one of them.
+	auto forSeeds = [&](int r, bool ring, const std::function<void(uint32_t)> &f){
+		for (int z = b[2] - r; z <= b[2] + r; z++)
+		for (int y = b[1] - r; y <= b[1] + r; y++)
+		for (int x = b[0] - r; x <= b[0] + r; x++)
+		{
+			if (x < 0 || bucketCount <= x || y < 0 || bucketCount <= y || z < 0 || bucketCount <= z)
+				continue;
+			if (ring && abs(x - b[0]) < r && abs(y - b[1]) < r && abs(z - b[2]) < r)
+				continue;
+			int bucket = (z * bucketCount + y) * bucketCount + x;
+			for (uint32_t k = bucketStart[bucket]; k < bucketStart[bucket + 1]; k++)
+				f(bucketSeeds[k]);
+		}
+	};
+
+	// The nearest seed h of the center, from the first ring of buckets that
+	// has any; one a little further only makes the lists below longer.
+	uint32_t h = 0;
+	float nearest2 = -1;
+	for (int r = 0; nearest2 < 0 && r <= bucketCount; r++)
+		forSeeds(r, true, [&](uint32_t g){
+			float d2 = (seeds[g] - c).LengthSq();
+			if (nearest2 < 0 || d2 < nearest2)
+			{
+				nearest2 = d2;
+				h = g;
+			}
+		});
+
+	// Grain g can only own a point p of a box if it is nearer to p than h is.
+	// For the center that needs |c - g| <= |c - h| plus the diagonal of the
+	// box, and for the box itself that the linear |p - g|^2 - |p - h|^2 is
+	// not positive at the corner where it is least.
+	const Vector3f &sh = seeds[h];
+	auto reaches = [&](const Vector3f &sg, const Vector3f &lo, const Vector3f &hi){
+		Vector3f corner(sg.x < sh.x ? lo.x : hi.x, sg.y < sh.y ? lo.y : hi.y, sg.z < sh.z ? lo.z : hi.z);
+		return (corner - sg).LengthSq() <= (corner - sh).LengthSq();
+	};
+	const Vector3f grow(margin, margin, margin);
+	const float limit = sqrt(nearest2) + (hi - lo + grow * 2).Length();
+	const int r = int(limit / bucketSize) + 1;
+	unsigned count = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		// Those reaching into the box, then those only reaching near it.
+		forSeeds(r, false, [&](uint32_t g){
+			const Vector3f &sg = seeds[g];
+			if ((sg - c).LengthSq() > limit * limit || reaches(sg, lo, hi) != (pass == 0)
+				|| !reaches(sg, lo - grow, hi + grow))
+				return;
+			if (out)
+				out[count] = g;
+			count++;
+		});
+		if (pass == 0)
+			owners = count;
+	}
+	return count;
+}
+
+int GrainGrid::BoxOf(const Vector3f &p) const
+{
+	int i[3];
+	for (int k = 0; k < 3; k++)
+	{
+		i[k] = int(floor((p[k] + half) / boxSize));
+		if (i[k] < 0 || n <= i[k])
+			return -1;
+	}
+	return (i[2] * n + i[1]) * n + i[0];
+}
+
+void GrainGrid::GetBox(int v, Vector3f &lo, Vector3f &hi) const
+{
+	lo = Vector3f(float(v % n), float(v / n % n), float(v / n / n)) * boxSize - Vector3f(half, half, half);
+	hi = lo + Vector3f(boxSize, boxSize, boxSize);
+}
+
+/// Atoms of one grain.
+struct GrainAtoms
+{
+	AtomArrays atoms;
+	Array<uint32_t> boundary; ///< Atoms closer than minDistance to another cell, ascending
+};
+
+// Fills grain g, whose lattice is oriented and placed at seeds[g], over the
+// boxes grid lists it in.
+static void FillGrain(const GrainGrid &grid, const Array<Vector3f> &seeds, uint32_t g, const LatticeDesc &oriented,
+	float minDistance, GrainAtoms &out)
+{
+	const Vector3f &seed = seeds[g];
+	const Vector3f &a = oriented.a;
+	Array<float> halfInvSpacing;
+	for (uint32_t k = grid.grainStart[g]; k < grid.grainStart[g + 1]; k++)
+	{
+		const int v = grid.grainBoxes[k];
+		const uint32_t *candidates = grid.GetCandidates(v);
+		const unsigned candidateCount = grid.GetCandidateCount(v);
+		// The distance of p to the plane halfway between seed g and seed h is
+		// (|p - h|^2 - |p - g|^2) / (2 |h - g|).
+		halfInvSpacing.Resize(candidateCount);
+		for (unsigned c = 0; c < candidateCount; c++)
+		{
+			float spacing = (seeds[candidates[c]] - seed).Length();
+			halfInvSpacing[c] = spacing > 0 ? 0.5f / spacing : 0;
+		}
+
+		// The box in fractional coordinates of the grain's lattice.
+		Vector3f lo, hi;
+		grid.GetBox(v, lo, hi);
+		Vector3f fmin(1e30f, 1e30f, 1e30f), fmax(-1e30f, -1e30f, -1e30f);
+		for (int corner = 0; corner < 8; corner++)
+		{
+			Vector3f p(corner & 1 ? hi.x : lo.x, corner & 2 ? hi.y : lo.y, corner & 4 ? hi.z : lo.z);
+			Vector3f f = oriented.ToFractional(p - seed);
+			for (int i = 0; i < 3; i++)
+			{
+				fmin[i] = f[i] < fmin[i] ? f[i] : fmin[i];
+				fmax[i] = fmax[i] < f[i] ? f[i] : fmax[i];
+			}
+		}
+
+		// Rows of lattice points along a, each clipped to the box. The bounds
+		// are widened a little so rounding cannot lose a point; BoxOf() decides.
+		const float slack = 1e-3f;
+		for (int b = 0; b < oriented.basisCount; b++)
+		{
+			const BasisAtom &ba = oriented.basis[b];
+			int j0 = int(ceil(fmin.y - ba.y - slack)), j1 = int(floor(fmax.y - ba.y + slack));
+			int k0 = int(ceil(fmin.z - ba.z - slack)), k1 = int(floor(fmax.z - ba.z + slack));
+			for (int kz = k0; kz <= k1; kz++)
+			for (int jy = j0; jy <= j1; jy++)
+			{
+				Vector3f origin = seed + oriented.ToCartesian(ba.x, ba.y + jy, ba.z + kz);
+				float tmin = -1e30f, tmax = 1e30f;
+				bool misses = false;
+				for (int i = 0; i < 3 && !misses; i++)
+				{
+					if (fabs(a[i]) < 1e-6f)
+					{
+						misses = origin[i] < lo[i] || hi[i] < origin[i];
+						continue;
+					}
+					float t0 = (lo[i] - origin[i]) / a[i], t1 = (hi[i] - origin[i]) / a[i];
+					tmin = t0 < t1 ? (tmin < t0 ? t0 : tmin) : (tmin < t1 ? t1 : tmin);
+					tmax = t0 < t1 ? (t1 < tmax ? t1 : tmax) : (t0 < tmax ? t0 : tmax);
+				}
+				if (misses || tmax < tmin)
+					continue;
+
+				for (int ix = int(ceil(tmin - slack)); ix <= int(floor(tmax + slack)); ix++)
+				{
+					Vector3f p = origin + a * float(ix);
+					if (grid.BoxOf(p) != v)
+						continue;
+
+					// Kept if g is the nearest seed, ties going to the lower index.
+					float own2 = (p - seed).LengthSq(), gap = 1e30f;
+					bool owned = true;
+					for (unsigned c = 0; c < candidateCount && owned; c++)
+					{
+						uint32_t h = candidates[c];
+						if (h == g)
+							continue;
+						float other2 = (p - seeds[h]).LengthSq();
+						owned = own2 < other2 || (own2 == other2 && g < h);
+						float d = (other2 - own2) * halfInvSpacing[c];
+						gap = d < gap ? d : gap;
+					}
+					if (!owned)
+						continue;
+					if (gap < minDistance)
+						out.boundary.PushBack(out.atoms.GetSize());
+					out.atoms.x.PushBack(p.x);
+					out.atoms.y.PushBack(p.y);
+					out.atoms.z.PushBack(p.z);
+					out.atoms.species.PushBack(ba.species);
+				}
+			}
+		}
+	}
+}
+
+void GeneratePolycrystal(const LatticeDesc &lattice, const PolycrystalDesc &desc, AtomArrays &atoms)
+{
+	const float cellSize = GetPolycrystalCellSize(lattice);
+	const float half = desc.cells * cellSize;
+	const unsigned grainCount = desc.grains > 1 ? desc.grains : 1;
+	const float minDistance = desc.minDistance;
+	WorkerPool &pool = WorkerPool::Shared();
+
+	// Seeds uniform in the sample, and orientations uniform over rotations.
+	Array<Vector3f> seeds;
+	Array<LatticeDesc> oriented;
+	seeds.Resize(grainCount);
+	oriented.Resize(grainCount);
+	uint32_t state = desc.seed ? desc.seed : 1;
+	for (unsigned g = 0; g < grainCount; g++)
+	{
+		for (int i = 0; i < 3; i++)
+			seeds[g][i] = (2 * NextUniform(state) - 1) * half;
+		const float twoPi = 6.28318531f;
+		float u = NextUniform(state), v = NextUniform(state) * twoPi, w = NextUniform(state) * twoPi;
+		Quatf q(sqrt(1 - u) * sin(v), sqrt(1 - u) * cos(v), sqrt(u) * sin(w), sqrt(u) * cos(w));
+		oriented[g] = lattice;
+		oriented[g].a = q.Rotate(lattice.a);
+		oriented[g].b = q.Rotate(lattice.b);
+		oriented[g].c = q.Rotate(lattice.c);
+	}
+
+	// Boxes a third of the spacing of the seeds list about six grains each,
+	// which every atom is tested against; smaller ones clip too many rows.
+	float boxSize = 2 * half / float(pow(double(grainCount), 1. / 3.)) / 3;
+	GrainGrid grid(seeds, half, boxSize < cellSize ? cellSize : boxSize, 2 * minDistance);
+	Array<GrainAtoms> grains;
+	grains.Resize(grainCount);
+	pool.ParallelFor(grainCount, [&](int begin, int end){
+		for (int g = begin; g < end; g++)
+			FillGrain(grid, seeds, g, oriented[g], minDistance, grains[g]);
+	});
+
+	// Only atoms near another cell can overlap one of it; gather them with
+	// their grains.
+	Array<uint32_t> nearStart;
+	nearStart.Resize(grainCount + 1);
+	nearStart[0] = 0;
+	for (unsigned g = 0; g < grainCount; g++)
+		nearStart[g + 1] = nearStart[g] + (uint32_t)grains[g].boundary.GetSize();
+	const unsigned nearCount = nearStart[grainCount];
+	AtomArrays nearAtoms;
+	Array<uint32_t> nearGrain;
+	Array<uint8_t> removed;
+	nearAtoms.Resize(nearCount);
+	nearGrain.Resize(nearCount);
+	removed.Resize(nearCount);
+	pool.ParallelFor(grainCount, [&](int begin, int end){
+		for (int g = begin; g < end; g++)
+			for (uint32_t k = nearStart[g]; k < nearStart[g + 1]; k++)
+			{
+				uint32_t i = grains[g].boundary[k - nearStart[g]];
+				nearAtoms.Set(k, grains[g].atoms, i);
+				nearGrain[k] = g;
+			}
+	});
+
+	if (nearCount && minDistance > 0)
+	{
+		NeighborGrid near;
+		near.Build(nearAtoms, minDistance);
+		pool.ParallelFor(nearCount, [&](int begin, int end){
+			Array<uint32_t> found;
+			for (int k = begin; k < end; k++)
+			{
+				found.Clear();
+				near.FindNear(nearAtoms.GetPos(k), minDistance, found);
+				removed[k] = 0;
+				for (unsigned f = 0; f < found.GetSize(); f++)
+					removed[k] |= nearGrain[found[f]] < nearGrain[k];
+			}
+		});
+	}
+	else if (nearCount)
+		memset(&removed[0], 0, nearCount);
+
+	// Concatenate the grains without the removed atoms.
+	Array<uint32_t> start;
+	start.Resize(grainCount + 1);
+	start[0] = 0;
+	for (unsigned g = 0; g < grainCount; g++)
+	{
+		unsigned kept = grains[g].atoms.GetSize();
+		for (uint32_t k = nearStart[g]; k < nearStart[g + 1]; k++)
+			kept -= removed[k];
+		start[g + 1] = start[g] + kept;
+	}
+	atoms.Resize(start[grainCount]);
+	pool.ParallelFor(grainCount, [&](int begin, int end){
+		for (int g = begin; g < end; g++)
+		{
+			const GrainAtoms &grain = grains[g];
+			uint32_t o = start[g], k = nearStart[g];
+			for (unsigned i = 0; i < grain.atoms.GetSize(); i++)
+			{
+				if (k < nearStart[g + 1] && grain.boundary[k - nearStart[g]] == i && removed[k++])
+					continue;
+				atoms.Set(o++, grain.atoms, i);
+			}
+		}
+	});
+}
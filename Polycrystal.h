@@ -0,0 +1,33 @@
+#ifndef POLYCRYSTAL_H
+#define POLYCRYSTAL_H
+
+#include "CrystalLattice.h"
+
+/// Parameters of GeneratePolycrystal()
+struct PolycrystalDesc
+{
+	int cells; ///< Half extent of the sample in cubes of GetPolycrystalCellSize()
+	int grains;
+	uint32_t seed; ///< The same seed gives the same grains
+	float minDistance; ///< Atoms of different grains closer than this overlap
+};
+
+/// Returns the edge of the cubes a polycrystal is measured in, which is the
+/// longest lattice vector.
+float GetPolycrystalCellSize(const LatticeDesc &lattice);
+
+/// Returns the shell of a polycrystal atom at p, counted like LatticeShell()
+/// in cubes of cellSize but no more than cells - 1.
+int PolycrystalShell(float cellSize, int cells, const Vector3f &p);
+
+/// Fills atoms with a polycrystal: the cube desc.cells cubes on either side
+/// of the origin is split into the Voronoi cells of desc.grains random seeds,
+/// and each cell is filled with the lattice rotated randomly about its seed.
+/// An atom closer than desc.minDistance to an atom of a grain with a lower
+/// index is removed. Each grain is filled in parallel over only the boxes of
+/// a coarse grid its cell can reach into, and overlaps are looked for only
+/// among the atoms that near a boundary, with a NeighborGrid. Atoms come out
+/// ordered by grain.
+void GeneratePolycrystal(const LatticeDesc &lattice, const PolycrystalDesc &desc, AtomArrays &atoms);
+
+#endif
@@ -41,6 +41,40 @@ static D3D11_INPUT_ELEMENT_DESC ModelVertexDesc[] =
     {"Normal",   0, DXGI_FORMAT_R32G32B32_FLOAT, 0, offsetof(Vertex, Norm),  D3D11_INPUT_PER_VERTEX_DATA, 0},
 };
 
+// Model vertex format in slot 0 plus AtomInstance records in slot 1.
+static D3D11_INPUT_ELEMENT_DESC AtomInstanceDesc[] =
+{
+    {"Position", 0, DXGI_FORMAT_R32G32B32_FLOAT,    0, offsetof(Vertex, Pos),        D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"Color",    0, DXGI_FORMAT_R8G8B8A8_UNORM,     0, offsetof(Vertex, C),          D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"TexCoord", 0, DXGI_FORMAT_R32G32_FLOAT,       0, offsetof(Vertex, U),          D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"Normal",   0, DXGI_FORMAT_R32G32B32_FLOAT,    0, offsetof(Vertex, Norm),       D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"TexCoord", 1, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, offsetof(AtomInstance, Pos),  D3D11_INPUT_PER_INSTANCE_DATA, 1},
+    {"Color",    1, DXGI_FORMAT_R8G8B8A8_UNORM,     1, offsetof(AtomInstance, C),    D3D11_INPUT_PER_INSTANCE_DATA, 1},
+};
+
+// Model vertex format in slot 0 plus BondInstance records in slot 1.
+static D3D11_INPUT_ELEMENT_DESC BondInstanceDesc[] =
+{
+    {"Position", 0, DXGI_FORMAT_R32G32B32_FLOAT,    0, offsetof(Vertex, Pos),          D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"Color",    0, DXGI_FORMAT_R8G8B8A8_UNORM,     0, offsetof(Vertex, C),            D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"TexCoord", 0, DXGI_FORMAT_R32G32_FLOAT,       0, offsetof(Vertex, U),            D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"Normal",   0, DXGI_FORMAT_R32G32B32_FLOAT,    0, offsetof(Vertex, Norm),         D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"TexCoord", 1, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, offsetof(BondInstance, Pos),    D3D11_INPUT_PER_INSTANCE_DATA, 1},
+    {"TexCoord", 2, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, offsetof(BondInstance, Rot),    D3D11_INPUT_PER_INSTANCE_DATA, 1},
+    {"TexCoord", 3, DXGI_FORMAT_R32_FLOAT,          1, offsetof(BondInstance, Radius), D3D11_INPUT_PER_INSTANCE_DATA, 1},
+    {"Color",    1, DXGI_FORMAT_R8G8B8A8_UNORM,     1, offsetof(BondInstance, C),      D3D11_INPUT_PER_INSTANCE_DATA, 1},
+};
+
+// Model vertex format in slot 0 plus BlockInstance records in slot 1.
+static D3D11_INPUT_ELEMENT_DESC BlockInstanceDesc[] =
+{
+    {"Position", 0, DXGI_FORMAT_R32G32B32_FLOAT,    0, offsetof(Vertex, Pos),            D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"Color",    0, DXGI_FORMAT_R8G8B8A8_UNORM,     0, offsetof(Vertex, C),              D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"TexCoord", 0, DXGI_FORMAT_R32G32_FLOAT,       0, offsetof(Vertex, U),              D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"Normal",   0, DXGI_FORMAT_R32G32B32_FLOAT,    0, offsetof(Vertex, Norm),           D3D11_INPUT_PER_VERTEX_DATA,   0},
+    {"TexCoord", 1, DXGI_FORMAT_R32G32B32_FLOAT,    1, offsetof(BlockInstance, Offset),  D3D11_INPUT_PER_INSTANCE_DATA, 1},
+};
+
 // These shaders are used to render the world, including lit vertex-colored and textured geometry.
 
 // Used for world geometry; has projection matrix.
@@ -66,6 +100,85 @@ static const char* StdVertexShaderSrc =
     "   ov.Color = Color;\n"
     "}\n";
 
+// Same as StdVertexShaderSrc, but scales and translates a unit mesh per AtomInstance.
+static const char* AtomInstancedVertexShaderSrc =
+    "float4x4 Proj;\n"
+    "float4x4 View;\n"
+    "struct Varyings\n"
+    "{\n"
+    "   float4 Position : SV_Position;\n"
+    "   float4 Color    : COLOR0;\n"
+    "   float2 TexCoord : TEXCOORD0;\n"
+    "   float3 Normal   : NORMAL;\n"
+    "   float3 VPos     : TEXCOORD4;\n"
+    "};\n"
+    "void main(in float4 Position : POSITION, in float4 Color : COLOR0, in float2 TexCoord : TEXCOORD0,"
+    "          in float3 Normal : NORMAL, in float4 InstPosRadius : TEXCOORD1, in float4 InstColor : COLOR1,\n"
+    "          out Varyings ov)\n"
+    "{\n"
+    "   float4 pos = float4(Position.xyz * InstPosRadius.w + InstPosRadius.xyz, 1);\n"
+    "   ov.Position = mul(Proj, mul(View, pos));\n"
+    "   ov.Normal = mul(View, Normal);\n"
+    "   ov.VPos = mul(View, pos);\n"
+    "   ov.TexCoord = TexCoord;\n"
+    "   ov.Color = InstColor;\n"
+    "}\n";
+
+// Same as StdVertexShaderSrc, but places a unit cylinder along each BondInstance.
+static const char* BondInstancedVertexShaderSrc =
+    "float4x4 Proj;\n"
+    "float4x4 View;\n"
+    "struct Varyings\n"
+    "{\n"
+    "   float4 Position : SV_Position;\n"
+    "   float4 Color    : COLOR0;\n"
+    "   float2 TexCoord : TEXCOORD0;\n"
+    "   float3 Normal   : NORMAL;\n"
+    "   float3 VPos     : TEXCOORD4;\n"
+    "};\n"
+    "float3 QuatRotate(float4 q, float3 v)\n"
+    "{\n"
+    "   float3 t = 2 * cross(q.xyz, v);\n"
+    "   return v + q.w * t + cross(q.xyz, t);\n"
+    "}\n"
+    "void main(in float4 Position : POSITION, in float4 Color : COLOR0, in float2 TexCoord : TEXCOORD0,"
+    "          in float3 Normal : NORMAL, in float4 InstPosHalfLength : TEXCOORD1, in float4 InstRot : TEXCOORD2,\n"
+    "          in float InstRadius : TEXCOORD3, in float4 InstColor : COLOR1,\n"
+    "          out Varyings ov)\n"
+    "{\n"
+    "   float3 local = Position.xyz * float3(InstRadius, InstRadius, InstPosHalfLength.w);\n"
+    "   float4 pos = float4(QuatRotate(InstRot, local) + InstPosHalfLength.xyz, 1);\n"
+    "   ov.Position = mul(Proj, mul(View, pos));\n"
+    "   ov.Normal = mul(View, float4(QuatRotate(InstRot, Normal), 0)).xyz;\n"
+    "   ov.VPos = mul(View, pos);\n"
+    "   ov.TexCoord = TexCoord;\n"
+    "   ov.Color = InstColor;\n"
+    "}\n";
+
+// Same as StdVertexShaderSrc, but translates the whole mesh per BlockInstance.
+static const char* BlockInstancedVertexShaderSrc =
+    "float4x4 Proj;\n"
+    "float4x4 View;\n"
+    "struct Varyings\n"
+    "{\n"
+    "   float4 Position : SV_Position;\n"
+    "   float4 Color    : COLOR0;\n"
+    "   float2 TexCoord : TEXCOORD0;\n"
+    "   float3 Normal   : NORMAL;\n"
+    "   float3 VPos     : TEXCOORD4;\n"
+    "};\n"
+    "void main(in float4 Position : POSITION, in float4 Color : COLOR0, in float2 TexCoord : TEXCOORD0,"
+    "          in float3 Normal : NORMAL, in float3 InstOffset : TEXCOORD1,\n"
+    "          out Varyings ov)\n"
+    "{\n"
+    "   float4 pos = float4(Position.xyz + InstOffset, 1);\n"
+    "   ov.Position = mul(Proj, mul(View, pos));\n"
+    "   ov.Normal = mul(View, Normal);\n"
+    "   ov.VPos = mul(View, pos);\n"
+    "   ov.TexCoord = TexCoord;\n"
+    "   ov.Color = Color;\n"
+    "}\n";
+
 // Used for text/clearing; no projection.
 static const char* DirectVertexShaderSrc =
     "float4x4 View : register(c4);\n"
@@ -175,8 +288,10 @@ static const char* LitTexturePixelShaderSrc =
 static const char* VShaderSrcs[VShader_Count] =
 {
     DirectVertexShaderSrc,
-    StdVertexShaderSrc
-
+    StdVertexShaderSrc,
+    AtomInstancedVertexShaderSrc,
+    BondInstancedVertexShaderSrc,
+    BlockInstancedVertexShaderSrc
 };
 static const char* FShaderSrcs[FShader_Count] =
 {
@@ -205,12 +320,14 @@ bool Buffer::Data(int use, const void *buffer, size_t size)
             {
                 memcpy(v, buffer, size);
                 Unmap(v);
+                Use = use;
                 return true;
             }
         }
         else
         {
-            Ren->Context->UpdateSubresource(D3DBuffer, 0, NULL, buffer, 0, 0);
+            Update(0, buffer, size);
+            Use = use;
             return true;
         }
     }
@@ -229,6 +346,11 @@ bool Buffer::Data(int use, const void *buffer, size_t size)
         desc.Usage = D3D11_USAGE_IMMUTABLE;
         desc.CPUAccessFlags = 0;
     }
+    else if (use & Buffer_Partial)
+    {
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.CPUAccessFlags = 0;
+    }
     else
     {
         desc.Usage = D3D11_USAGE_DYNAMIC;
@@ -264,6 +386,21 @@ bool Buffer::Data(int use, const void *buffer, size_t size)
     return 0;
 }
 
+bool Buffer::Update(size_t start, const void *buffer, size_t size)
+{
+    if (!D3DBuffer || Dynamic || !buffer || start + size > Size)
+        return false;
+
+    // The copy is queued behind draws still reading the old contents.
+    D3D11_BOX box;
+    box.left = (UINT)start;
+    box.right = (UINT)(start + size);
+    box.top = box.front = 0;
+    box.bottom = box.back = 1;
+    Ren->Context->UpdateSubresource(D3DBuffer, 0, &box, buffer, 0, 0);
+    return true;
+}
+
 void*  Buffer::Map(size_t start, size_t size, int flags)
 {
 	OVR_UNUSED(size);
@@ -455,8 +592,44 @@ void Model::Render(const Matrix4f& ltw, RenderDevice* ren)
     }
 }
 
+void InstancedModel::Render(const Matrix4f& ltw, RenderDevice* ren)
+{
+    if (Visible && GetDrawCount())
+    {
+        Matrix4f m = ltw * GetMatrix();
+        ren->Render(m, this);
+    }
+}
+
+void LodInstancedModel::Render(const Matrix4f& ltw, RenderDevice* ren)
+{
+    if (!Visible || !GetDrawCount())
+        return;
+
+    // The nearest instance is at least this far from the eye.
+    Matrix4f m = ltw * GetMatrix();
+    float distance = m.Transform(BoundsCenter).Length() - BoundsRadius;
+    float pixels = InstanceSize * ren->GetPixelsPerUnit() / (distance > 0.01f ? distance : 0.01f);
+
+    int count = (int)Levels.GetSize();
+    int level = CurrentLevel;
+    while (level > 0 && pixels > Levels[level - 1].MinPixels * (1 + LodHysteresis))
+        level--;
+    while (level < count && pixels < Levels[level].MinPixels * (1 - LodHysteresis))
+        level++;
+    CurrentLevel = level;
+
+    if (level < count)
+    {
+        Mesh = Levels[level].Mesh;
+        ren->Render(m, this);
+    }
+}
+
 void Container::Render(const Matrix4f& ltw, RenderDevice* ren)
 {
+    if (!Visible)
+        return;
     Matrix4f m = ltw * GetMatrix();
     for(unsigned i = 0; i < Nodes.GetSize(); i++)
     {
@@ -557,7 +730,7 @@ void Model::AddSolidColorBox(float x1, float y1, float z1,
     };
 
 
-    uint16_t startIndex = GetNextVertexIndex();
+    uint32_t startIndex = GetNextVertexIndex();
 
     enum
     {
@@ -579,40 +752,59 @@ void Model::AddSolidColorBox(float x1, float y1, float z1,
     }
 }
 
-void Model::AddSphere(float scale)
+// Fills s[i] and c[i] with the sine and cosine of i * step + offset for i in [0, count].
+static void MakeTrigTable(int count, double step, double offset, Array<float> &s, Array<float> &c)
+{
+	s.Resize(count + 1);
+	c.Resize(count + 1);
+	for (int i = 0; i <= count; i++)
+	{
+		s[i] = (float)sin(i * step + offset);
+		c[i] = (float)cos(i * step + offset);
+	}
+}
+
+void Model::AddSphere(float scale, int slices, int stacks)
 {
 	const double M_PI = 3.14159265358979;
-	int slices = 16, stacks = 8;
+	OVR_ASSERT(!VertexBuffer && !IndexBuffer);
+
+	uint32_t startIndex = GetNextVertexIndex();
+
+	// Every vertex of a slice shares its angle, as does every vertex of a
+	// stack, so the trigonometry is done once per row instead of per vertex.
+	Array<float> sinS, cosS, sinT, cosT;
+	MakeTrigTable(slices, M_PI * 2. / slices, 0, sinS, cosS);
+	MakeTrigTable(stacks, M_PI / stacks, -M_PI, sinT, cosT);
 
-	uint16_t startIndex = GetNextVertexIndex();
+	Vertices.Reserve(Vertices.GetSize() + 2 + (slices + 1) * (stacks + 1));
+	Indices.Reserve(Indices.GetSize() + slices * stacks * 6);
 
 	Vector3f northPos(0, scale, 0);
-	AddVertex(Vertex(northPos, Color(127, 127, 127, 255), 0, 1, northPos));
+	Vertices.PushBack(Vertex(northPos, Color(127, 127, 127, 255), 0, 1, northPos));
 
 	Vector3f southPos(0, -scale, 0);
-	AddVertex(Vertex(southPos, Color(127, 127, 127, 255), 0, 0, southPos));
+	Vertices.PushBack(Vertex(southPos, Color(127, 127, 127, 255), 0, 0, southPos));
 
 	for (int s = 0; s <= slices; s++)
 	{
-		double sangle = s * M_PI * 2. / slices;
 		for (int t = 0; t <= stacks; t++)
 		{
-			double tangle = t * M_PI / stacks - M_PI;
-			Vector3f v = Vector3f(cos(sangle) * sin(tangle), cos(tangle), sin(sangle) * sin(tangle));
-			AddVertex(Vertex(v * scale, Color(127,127,127,255), float(s), float(t), v));
+			Vector3f v = Vector3f(cosS[s] * sinT[t], cosT[t], sinS[s] * sinT[t]);
+			Vertices.PushBack(Vertex(v * scale, Color(127,127,127,255), float(s), float(t), v));
 		}
 	}
 
 	startIndex += 2;
 
 	// Renumber indices
-	for (uint16_t s = 0; s < slices; s++)
+	for (uint32_t s = 0; s < (uint32_t)slices; s++)
 	{
-		for (uint16_t t = 0; t < stacks; t++)
+		for (uint32_t t = 0; t < (uint32_t)stacks; t++)
 		{
-			uint16_t s1 = s + 1;
-			uint16_t t1 = t + 1;
-			auto get = [&](uint16_t s, uint16_t t){
+			uint32_t s1 = s + 1;
+			uint32_t t1 = t + 1;
+			auto get = [&](uint32_t s, uint32_t t){
 				return s * (stacks + 1) + t + startIndex;
 			};
 			AddTriangle(get(s, t),
@@ -625,28 +817,33 @@ void Model::AddSphere(float scale)
 	}
 }
 
-void Model::AddCylinder(float radius, float height)
+void Model::AddCylinder(float radius, float height, int segments)
 {
 	const double M_PI = 3.14159265358979;
-	int round = 6;
+	OVR_ASSERT(!VertexBuffer && !IndexBuffer);
 
-	uint16_t startIndex = GetNextVertexIndex();
+	uint32_t startIndex = GetNextVertexIndex();
 
-	for(int i = 0; i <= round; i++)
+	Array<float> sinS, cosS;
+	MakeTrigTable(segments, M_PI * 2. / segments, 0, sinS, cosS);
+
+	Vertices.Reserve(Vertices.GetSize() + (segments + 1) * 2);
+	Indices.Reserve(Indices.GetSize() + segments * 6);
+
+	for(int i = 0; i <= segments; i++)
 	{
-		double sangle = i * M_PI * 2. / round;
 		for (int t = -1; t <= 1; t += 2)
 		{
-			Vector3f v = Vector3f(cos(sangle) * radius, sin(sangle) * radius, t * height);
-			AddVertex(Vertex(v, Color(127, 0, 127, 255), float(i), float(t), Vector3f(cos(sangle), sin(sangle), 0)));
+			Vector3f v = Vector3f(cosS[i] * radius, sinS[i] * radius, t * height);
+			Vertices.PushBack(Vertex(v, Color(127, 0, 127, 255), float(i), float(t), Vector3f(cosS[i], sinS[i], 0)));
 		}
 	}
 
 	// Renumber indices
-	for (uint16_t s = 0; s < round; s++)
+	for (uint32_t s = 0; s < (uint32_t)segments; s++)
 	{
-		uint16_t s1 = s + 1;
-		auto get = [&](uint16_t s, uint16_t t){
+		uint32_t s1 = s + 1;
+		auto get = [&](uint32_t s, uint32_t t){
 			return s * 2 + t + startIndex;
 		};
 		AddTriangle(get(s, 0),
@@ -779,11 +976,30 @@ void  RenderDevice::initShadersAndStates()
 
     ID3D10Blob* vsData = CompileShader("vs_4_0", DirectVertexShaderSrc);
     VertexShaders[VShader_MV] = *new VertexShader(this, vsData);
-    for(int i = 1; i < VShader_Count; i++)
+    for(int i = 1; i < VShader_AtomInstanced; i++)
     {
         VertexShaders[i] = *new VertexShader(this, CompileShader("vs_4_0", VShaderSrcs[i]));
     }
 
+    // Instancing shaders need their blobs to create the matching input layouts.
+    ID3D10Blob* atomVsData = CompileShader("vs_4_0", VShaderSrcs[VShader_AtomInstanced]);
+    VertexShaders[VShader_AtomInstanced] = *new VertexShader(this, atomVsData);
+    AtomInstanceIL = NULL;
+    Device->CreateInputLayout(AtomInstanceDesc, sizeof(AtomInstanceDesc)/sizeof(D3D11_INPUT_ELEMENT_DESC),
+        atomVsData->GetBufferPointer(), atomVsData->GetBufferSize(), &AtomInstanceIL.GetRawRef());
+
+    ID3D10Blob* bondVsData = CompileShader("vs_4_0", VShaderSrcs[VShader_BondInstanced]);
+    VertexShaders[VShader_BondInstanced] = *new VertexShader(this, bondVsData);
+    BondInstanceIL = NULL;
+    Device->CreateInputLayout(BondInstanceDesc, sizeof(BondInstanceDesc)/sizeof(D3D11_INPUT_ELEMENT_DESC),
+        bondVsData->GetBufferPointer(), bondVsData->GetBufferSize(), &BondInstanceIL.GetRawRef());
+
+    ID3D10Blob* blockVsData = CompileShader("vs_4_0", VShaderSrcs[VShader_BlockInstanced]);
+    VertexShaders[VShader_BlockInstanced] = *new VertexShader(this, blockVsData);
+    BlockInstanceIL = NULL;
+    Device->CreateInputLayout(BlockInstanceDesc, sizeof(BlockInstanceDesc)/sizeof(D3D11_INPUT_ELEMENT_DESC),
+        blockVsData->GetBufferPointer(), blockVsData->GetBufferSize(), &BlockInstanceIL.GetRawRef());
+
     for(int i = 0; i < FShader_Count; i++)
     {
         PixelShaders[i] = *new PixelShader(this, CompileShader("ps_4_0", FShaderSrcs[i]));
@@ -1494,9 +1710,8 @@ void RenderDevice::SetWorldUniforms(const Matrix4f& proj)
 }
 
 
-void RenderDevice::Render(const Matrix4f& view, Model* model)
+void RenderDevice::CreateModelBuffers(Model* model)
 {
-    // Store data in buffers if not already
     if (!model->VertexBuffer)
     {
         Ptr<Buffer> vb = *CreateBuffer();
@@ -1506,9 +1721,27 @@ void RenderDevice::Render(const Matrix4f& view, Model* model)
     if (!model->IndexBuffer)
     {
         Ptr<Buffer> ib = *CreateBuffer();
-        ib->Data(Buffer_Index, &model->Indices[0], model->Indices.GetSize() * 2);
+        if (model->NeedsIndex32())
+        {
+            ib->Data(Buffer_Index | Buffer_Index32, &model->Indices[0], model->Indices.GetSize() * sizeof(uint32_t));
+        }
+        else
+        {
+            // Half the index bandwidth for the common small mesh.
+            Array<uint16_t> narrow;
+            narrow.Resize(model->Indices.GetSize());
+            for (unsigned i = 0; i < narrow.GetSize(); i++)
+                narrow[i] = (uint16_t)model->Indices[i];
+            ib->Data(Buffer_Index, &narrow[0], narrow.GetSize() * sizeof(uint16_t));
+        }
         model->IndexBuffer = ib;
     }
+}
+
+void RenderDevice::Render(const Matrix4f& view, Model* model)
+{
+    // Store data in buffers if not already
+    CreateModelBuffers(model);
 
     Render(model->Fill ? model->Fill : DefaultFill,
            model->VertexBuffer, model->IndexBuffer,sizeof(Vertex),
@@ -1516,6 +1749,39 @@ void RenderDevice::Render(const Matrix4f& view, Model* model)
 }
 
 
+void RenderDevice::Render(const Matrix4f& view, InstancedModel* model)
+{
+    Model* mesh = model->Mesh;
+    CreateModelBuffers(mesh);
+    if (!model->InstanceBuffer)
+    {
+        model->InstanceBuffer = *CreateBuffer();
+        model->InstancesDirty = true;
+    }
+    if (model->InstancesDirty)
+    {
+        // This overwrites the buffer in place unless the instance count has grown.
+        model->InstanceBuffer->Data(Buffer_Vertex | Buffer_Partial, model->Instances,
+                                    model->InstanceCount * model->InstanceStride);
+        model->InstancesDirty = false;
+        model->DirtyBegin = model->DirtyEnd = 0;
+    }
+    else if (model->DirtyBegin < model->DirtyEnd)
+    {
+        // Edited records only.
+        size_t start = model->DirtyBegin * model->InstanceStride;
+        model->InstanceBuffer->Update(start, model->Instances + start,
+                                      (model->DirtyEnd - model->DirtyBegin) * model->InstanceStride);
+        model->DirtyBegin = model->DirtyEnd = 0;
+    }
+
+    Render(model->Fill ? model->Fill : DefaultFill,
+           mesh->VertexBuffer, mesh->IndexBuffer, sizeof(Vertex),
+           view, 0, (unsigned)mesh->Indices.GetSize(), mesh->GetPrimType(), true,
+           model->InstanceBuffer, model->InstanceStride, model->GetDrawCount());
+}
+
+
 //Cut down one for ORT for simplicity
 void RenderDevice::Render(const ShaderFill* fill, Buffer* vertices, Buffer* indices, int stride)
 {
@@ -1524,7 +1790,8 @@ void RenderDevice::Render(const ShaderFill* fill, Buffer* vertices, Buffer* indi
 
 
 void RenderDevice::Render(const ShaderFill* fill, Buffer* vertices, Buffer* indices, int stride,
-                          const Matrix4f& matrix, int offset, int count, PrimitiveType rprim, bool updateUniformData)
+                          const Matrix4f& matrix, int offset, int count, PrimitiveType rprim, bool updateUniformData,
+                          Buffer* instances, int instanceStride, int instanceCount)
 {
 
     if(((ShaderFill*)fill)->GetInputLayout() != NULL)
@@ -1534,7 +1801,8 @@ void RenderDevice::Render(const ShaderFill* fill, Buffer* vertices, Buffer* indi
 
     if (indices)
     {
-        Context->IASetIndexBuffer(((Buffer*)indices)->GetBuffer(), DXGI_FORMAT_R16_UINT, 0);
+        DXGI_FORMAT indexFormat = (indices->Use & Buffer_Index32) ? DXGI_FORMAT_R32_UINT : DXGI_FORMAT_R16_UINT;
+        Context->IASetIndexBuffer(((Buffer*)indices)->GetBuffer(), indexFormat, 0);
     }
 
     ID3D11Buffer* vertexBuffer = ((Buffer*)vertices)->GetBuffer();
@@ -1543,6 +1811,14 @@ void RenderDevice::Render(const ShaderFill* fill, Buffer* vertices, Buffer* indi
 	UINT vertexOffset = offset;
     Context->IASetVertexBuffers(0, 1, &vertexBuffer, &vertexStride, &vertexOffset);
 
+    if (instances)
+    {
+        ID3D11Buffer* instanceBuffer = instances->GetBuffer();
+        UINT instStride = instanceStride;
+        UINT instOffset = 0;
+        Context->IASetVertexBuffers(1, 1, &instanceBuffer, &instStride, &instOffset);
+    }
+
     ShaderSet* shaders = ((ShaderFill*)fill)->GetShaders();
 
     ShaderBase* vshader = ((ShaderBase*)shaders->GetShader(Shader_Vertex));
@@ -1587,7 +1863,14 @@ void RenderDevice::Render(const ShaderFill* fill, Buffer* vertices, Buffer* indi
 
     fill->Set(rprim);
 
-    if (indices)
+    if (instances)
+    {
+        if (indices)
+            Context->DrawIndexedInstanced(count, instanceCount, 0, 0, 0);
+        else
+            Context->DrawInstanced(count, instanceCount, 0, 0);
+    }
+    else if (indices)
     {
         Context->DrawIndexed(count, 0, 0);
     }
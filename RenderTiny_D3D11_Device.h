@@ -63,7 +63,10 @@ enum BuiltinShaders
 {
     VShader_MV                      = 0,
     VShader_MVP                     = 1,
-    VShader_Count                   = 2,
+    VShader_AtomInstanced           = 2,
+    VShader_BondInstanced           = 3,
+    VShader_BlockInstanced          = 4,
+    VShader_Count                   = 5,
 
     FShader_Solid                   = 0,
     FShader_Gouraud                 = 1,
@@ -90,6 +93,8 @@ enum BufferUsage
     Buffer_Uniform  = 4,
     Buffer_TypeMask = 0xff,
     Buffer_ReadOnly = 0x100, // Buffer must be created with Data().
+    Buffer_Index32  = 0x200, // Index buffer holds 32-bit rather than 16-bit indices.
+    Buffer_Partial  = 0x400, // Buffer lives in GPU memory and is updated in parts with Update().
 };
 
 enum TextureFormat
@@ -323,7 +328,7 @@ public:
     bool              Dynamic;
 
 public:
-    Buffer(RenderDevice* r) : Ren(r), Size(0), Use(0) {}
+    Buffer(RenderDevice* r) : Ren(r), Size(0), Use(0), Dynamic(false) {}
     virtual ~Buffer() {}
 
     ID3D11Buffer* GetBuffer()
@@ -339,6 +344,8 @@ public:
     virtual bool   Unmap(void *m);
     // Allocates a buffer, optionally filling it with data.
     virtual bool   Data(int use, const void* buffer, size_t size);
+    // Overwrites size bytes from start of a Buffer_Partial buffer.
+    virtual bool   Update(size_t start, const void* buffer, size_t size);
 };
 
 class Texture : public RefCountBase<Texture>
@@ -404,7 +411,8 @@ public:
     {
         Node_NonDisplay,
         Node_Container,
-        Node_Model
+        Node_Model,
+        Node_InstancedModel
     };
     virtual NodeType GetType() const { return Node_NonDisplay; }
 
@@ -462,6 +470,39 @@ struct Vertex
     }
 };
 
+// Per-instance record for VShader_AtomInstanced; the mesh is a unit sphere
+// that is scaled by Radius and translated to Pos.
+struct AtomInstance
+{
+    Vector3f  Pos;
+    float     Radius;
+    Color     C;
+
+    AtomInstance(const Vector3f& p = Vector3f(0), float r = 1.0f, const Color& c = Color(127,127,127,255))
+        : Pos(p), Radius(r), C(c)
+    {}
+};
+
+// Per-instance record for VShader_BondInstanced; the mesh is a unit cylinder along Z
+// spanning [-1,1] that is scaled by (Radius, Radius, HalfLength), rotated by Rot and
+// translated to Pos, the midpoint of the bond.
+struct BondInstance
+{
+    Vector3f  Pos;
+    float     HalfLength;
+    Quatf     Rot;
+    float     Radius;
+    Color     C;
+};
+
+
+// Per-instance record for VShader_BlockInstanced; the mesh, e.g. a block of
+// several unit cells, is drawn translated by Offset with its own vertex colors.
+struct BlockInstance
+{
+    Vector3f  Offset;
+};
+
 
 // LightingParams are stored in a uniform buffer, don't change it without fixing all renderers
 // Scene contains a set of LightingParams that is uses for rendering.
@@ -503,7 +544,8 @@ class Model : public Node
 {
 public:
     Array<Vertex>     Vertices;
-    Array<uint16_t>   Indices;
+    // Always 32-bit here; uploaded as 16-bit when the vertex count allows it.
+    Array<uint32_t>   Indices;
     PrimitiveType     Type;
     Ptr<ShaderFill>   Fill;
     bool              Visible;	
@@ -528,52 +570,209 @@ public:
 
 
     // Returns the index next added vertex will have.
-    uint16_t GetNextVertexIndex() const
+    uint32_t GetNextVertexIndex() const
+    {
+        return (uint32_t)Vertices.GetSize();
+    }
+
+    // True if the vertices cannot be addressed by a 16-bit index buffer.
+    bool NeedsIndex32() const
     {
-        return (uint16_t)Vertices.GetSize();
+        return Vertices.GetSize() > 0x10000;
     }
 
-    uint16_t AddVertex(const Vertex& v)
+    uint32_t AddVertex(const Vertex& v)
     {
         OVR_ASSERT(!VertexBuffer && !IndexBuffer);
-        uint16_t index = (uint16_t)Vertices.GetSize();
+        uint32_t index = (uint32_t)Vertices.GetSize();
         Vertices.PushBack(v);
         return index;
     }
 
-    void AddTriangle(uint16_t a, uint16_t b, uint16_t c)
+    void AddTriangle(uint32_t a, uint32_t b, uint32_t c)
     {
         Indices.PushBack(a);
         Indices.PushBack(b);
         Indices.PushBack(c);
     }
 
+    // For Prim_Lines models.
+    void AddLine(uint32_t a, uint32_t b)
+    {
+        Indices.PushBack(a);
+        Indices.PushBack(b);
+    }
+
     // Uses texture coordinates for uniform world scaling (must use a repeat sampler).
     void  AddSolidColorBox(float x1, float y1, float z1,
                            float x2, float y2, float z2,
                            Color c);
 
-	void AddSphere(float scale = 1.0f);
+	// Tessellated in slices around the y axis and stacks from pole to pole.
+	void AddSphere(float scale = 1.0f, int slices = 16, int stacks = 8);
+
+	// Open cylinder around the z axis from -length to length.
+	void AddCylinder(float radius = 1.0f, float length = 1.0f, int segments = 6);
+};
+
+
+// InstancedModel draws a shared Mesh once per instance record with a single
+// instanced draw call. The Fill must use an instancing vertex shader and its matching
+// input layout, e.g. VShader_AtomInstanced with RenderDevice::AtomInstanceIL or
+// VShader_BondInstanced with RenderDevice::BondInstanceIL, or VShader_BlockInstanced
+// with RenderDevice::BlockInstanceIL.
+class InstancedModel : public Node
+{
+public:
+    Ptr<Model>        Mesh;
+    Ptr<ShaderFill>   Fill;
+    bool              Visible;
+
+    // Packed per-instance records, InstanceStride bytes each. They are either
+    // in InstanceData or, after SetInstances(), in memory owned by someone else.
+    Array<uint8_t>    InstanceData;
+    uint8_t*          Instances;
+    unsigned          InstanceCount;
+    int               InstanceStride;
+    unsigned          DrawCount;      // Leading records drawn, at most InstanceCount
+
+    // Created by the renderer on first use, like Model::VertexBuffer, and
+    // uploaded again on the next render after InvalidateInstances().
+    Ptr<Buffer>       InstanceBuffer;
+    bool              InstancesDirty;
+    unsigned          DirtyBegin, DirtyEnd; // Records changed since the last upload, if not all
+
+    InstancedModel(Model* mesh, int stride) : Mesh(mesh), Fill(NULL), Visible(true), Instances(NULL), InstanceCount(0),
+                                              InstanceStride(stride), DrawCount(0), InstancesDirty(false),
+                                              DirtyBegin(0), DirtyEnd(0) { }
+    ~InstancedModel() { }
+
+    void          SetVisible(bool visible) { Visible = visible; }
+    bool          IsVisible() const        { return Visible; }
+
+    unsigned GetInstanceCount() const
+    {
+        return InstanceCount;
+    }
+
+    // Allocates storage for count instances and returns it for filling in.
+    template<class T> T* ResizeInstances(unsigned count)
+    {
+        OVR_ASSERT(sizeof(T) == (size_t)InstanceStride);
+        InstanceData.Resize(count * sizeof(T));
+        Instances = count ? &InstanceData[0] : NULL;
+        InstanceCount = DrawCount = count;
+        InvalidateInstances();
+        return (T*)Instances;
+    }
+
+    // Uses count records at data, which must stay valid as long as the model,
+    // e.g. a range of a SceneArena.
+    template<class T> void SetInstances(T* data, unsigned count)
+    {
+        OVR_ASSERT(sizeof(T) == (size_t)InstanceStride);
+        InstanceData.ClearAndRelease();
+        Instances = (uint8_t*)data;
+        InstanceCount = DrawCount = count;
+        InvalidateInstances();
+    }
+
+    // Draws only the first count records. All of them stay uploaded, so this
+    // is free in both directions.
+    void SetDrawCount(unsigned count)      { DrawCount = count < InstanceCount ? count : InstanceCount; }
+    unsigned GetDrawCount() const          { return DrawCount; }
+
+    // Call after changing the records returned by GetInstances().
+    void InvalidateInstances()             { InstancesDirty = true; }
+    // Call after changing count records from first; unless the whole buffer is
+    // invalid, only the range spanning these and other such records is uploaded.
+    void InvalidateInstances(unsigned first, unsigned count)
+    {
+        if (DirtyBegin == DirtyEnd)
+        {
+            DirtyBegin = first;
+            DirtyEnd = first + count;
+        }
+        else
+        {
+            DirtyBegin = first < DirtyBegin ? first : DirtyBegin;
+            DirtyEnd = DirtyEnd < first + count ? first + count : DirtyEnd;
+        }
+    }
+
+    template<class T> T* GetInstances()
+    {
+        OVR_ASSERT(sizeof(T) == (size_t)InstanceStride);
+        return (T*)Instances;
+    }
+
+    // Node implementation.
+    virtual NodeType GetType() const       { return Node_InstancedModel; }
+    virtual void    Render(const Matrix4f& ltw, RenderDevice* ren);
+};
+
+
+// LodInstancedModel is an InstancedModel that draws its instances with one of several
+// tessellations of the same shape. On every render it estimates how many pixels the
+// instance nearest the eye covers and picks the coarsest level whose MinPixels that
+// still exceeds; below the last level the whole model is skipped. Levels only switch
+// once the size is LodHysteresis past a threshold, so they don't flicker at the
+// boundary. Instances should be grouped spatially, a few units across per model.
+class LodInstancedModel : public InstancedModel
+{
+public:
+    struct Level
+    {
+        Ptr<Model>  Mesh;
+        float       MinPixels;  // Smallest projected instance size drawn with this level
+    };
+
+    Array<Level>      Levels;         // Finest first
+    Vector3f          BoundsCenter;   // Sphere around all instances, in model space
+    float             BoundsRadius;
+    float             InstanceSize;   // Extent measured against MinPixels, e.g. a diameter
+    int               CurrentLevel;   // Levels.GetSize() while skipped
 
-	void AddCylinder(float radius = 1.0f, float length = 1.0f);
+    LodInstancedModel(const Array<Level>& levels, int stride)
+        : InstancedModel(levels[0].Mesh, stride), Levels(levels), BoundsRadius(0),
+          InstanceSize(1), CurrentLevel(0) { }
+
+    virtual void    Render(const Matrix4f& ltw, RenderDevice* ren);
 };
 
+// Fraction a projected size must pass a level threshold by to switch level.
+static const float LodHysteresis = 0.2f;
+
 
 // Container stores a collection of rendering nodes (Models or other containers).
 class Container : public Node
 {
 public:
     Array<Ptr<Node> > Nodes;
+    bool              Visible;
 
-    Container()  { }
+    Container() : Visible(true) { }
     ~Container() { }
 
     virtual NodeType GetType() const { return Node_Container; }
 
+    void          SetVisible(bool visible) { Visible = visible; }
+    bool          IsVisible() const        { return Visible; }
+
     virtual void Render(const Matrix4f& ltw, RenderDevice* ren);
 
     void Add(Node *n)  { Nodes.PushBack(n); }	
     void Clear()       { Nodes.Clear(); }	
+
+    void Remove(Node *n)
+    {
+        for (unsigned i = 0; i < Nodes.GetSize(); i++)
+            if (Nodes[i] == n)
+            {
+                Nodes.RemoveAt(i);
+                return;
+            }
+    }
 };
 
 
@@ -686,6 +885,9 @@ public:
     Ptr<ID3D11DepthStencilState> DepthStates[1 + 2 * Compare_Count];
     Ptr<ID3D11DepthStencilState> CurDepthState;
     Ptr<ID3D11InputLayout>      ModelVertexIL;
+    Ptr<ID3D11InputLayout>      AtomInstanceIL;
+    Ptr<ID3D11InputLayout>      BondInstanceIL;
+    Ptr<ID3D11InputLayout>      BlockInstanceIL;
 
     Ptr<ID3D11SamplerState>     SamplerStates[Sample_Count];
 
@@ -794,11 +996,23 @@ public:
 
     virtual Matrix4f GetProjection() const { return Proj; }
 
+    // Pixels covered by a unit length facing the eye at unit distance, for
+    // the current projection and viewport.
+    float        GetPixelsPerUnit() const { return Proj.M[1][1] * D3DViewport.Height * 0.5f; }
+
+    // Creates the vertex and index buffers of a model if it doesn't have them yet.
+    // Indices are uploaded as 16-bit unless the model has too many vertices.
+    void         CreateModelBuffers(Model* model);
+
     // This is a View matrix only, it will be combined with the projection matrix from SetProjection
     virtual void Render(const Matrix4f& view, Model* model);
+    virtual void Render(const Matrix4f& view, InstancedModel* model);
     virtual void Render(const ShaderFill* fill, Buffer* vertices, Buffer* indices,int stride);
+    // If instances is given, the geometry is drawn instanceCount times with the instance
+    // buffer bound to input slot 1.
     virtual void Render(const ShaderFill* fill, Buffer* vertices, Buffer* indices,int stride,
-                        const Matrix4f& matrix, int offset, int count, PrimitiveType prim = Prim_Triangles, bool updateUniformData = true);
+                        const Matrix4f& matrix, int offset, int count, PrimitiveType prim = Prim_Triangles, bool updateUniformData = true,
+                        Buffer* instances = NULL, int instanceStride = 0, int instanceCount = 0);
 
     virtual ShaderFill *CreateSimpleFill() { return DefaultFill; }
     ShaderFill *        CreateTextureFill(Texture* tex);
@@ -0,0 +1,57 @@
+#include "SceneArena.h"
+#include <stdlib.h>
+
+SceneArena::~SceneArena()
+{
+	for (unsigned i = 0; i < blocks.GetSize(); i++)
+		free(blocks[i].data);
+}
+
+void *SceneArena::Alloc(size_t size, size_t align)
+{
+	// Try the current block, then any kept by Reset(), before asking the heap.
+	for (; current < blocks.GetSize(); current++, offset = 0)
+	{
+		const Block &b = blocks[current];
+		size_t start = (((size_t)b.data + offset + align - 1) & ~(align - 1)) - (size_t)b.data;
+		if (start + size <= b.size)
+		{
+			offset = start + size;
+			return b.data + start;
+		}
+	}
+
+	Block b;
+	b.size = size + align > blockSize ? size + align : blockSize;
+	b.data = (uint8_t*)malloc(b.size);
+	// Callers write whole scenes here without checking, so running out of
+	// memory must not go unnoticed.
+	OVR_ASSERT(b.data);
+	if (!b.data)
+		abort();
+	blocks.PushBack(b);
+	current = (unsigned)blocks.GetSize() - 1;
+	size_t start = (((size_t)b.data + align - 1) & ~(align - 1)) - (size_t)b.data;
+	offset = start + size;
+	return b.data + start;
+}
+
+void SceneArena::Trim(size_t keep)
+{
+	Reset();
+	size_t kept = 0;
+	unsigned count = 0;
+	for (; count < blocks.GetSize() && kept + blocks[count].size <= keep; count++)
+		kept += blocks[count].size;
+	for (unsigned i = count; i < blocks.GetSize(); i++)
+		free(blocks[i].data);
+	blocks.Resize(count);
+}
+
+size_t SceneArena::GetCapacity() const
+{
+	size_t total = 0;
+	for (unsigned i = 0; i < blocks.GetSize(); i++)
+		total += blocks[i].size;
+	return total;
+}
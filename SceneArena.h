@@ -0,0 +1,52 @@
+#ifndef SCENEARENA_H
+#define SCENEARENA_H
+
+#include "Kernel/OVR_Types.h"
+#include "Kernel/OVR_Array.h"
+
+using namespace OVR;
+
+/// A bump allocator for data that lives exactly as long as one scene, such as
+/// instance records. Memory comes from a few large blocks and nothing is freed
+/// on its own: Reset() makes all of it available again in O(1) while keeping
+/// the blocks, and the destructor frees the blocks. Destructors of objects
+/// placed here never run, so it only suits plain data.
+class SceneArena{
+public:
+	SceneArena(size_t blockSize = 4 << 20) : blockSize(blockSize), current(0), offset(0){}
+	~SceneArena();
+
+	/// Returns size bytes aligned to align, which must be a power of two.
+	/// Aborts if the heap is out of memory, so the result is never NULL.
+	void *Alloc(size_t size, size_t align = 16);
+
+	/// Returns uninitialized storage for count objects of type T.
+	template<class T> T *AllocArray(size_t count){
+		return (T*)Alloc(count * sizeof(T));
+	}
+
+	/// Forgets every allocation but keeps the blocks for reuse.
+	void Reset(){
+		current = 0;
+		offset = 0;
+	}
+
+	/// Forgets every allocation like Reset(), and frees the blocks beyond
+	/// the first ones that hold up to keep bytes.
+	void Trim(size_t keep);
+
+	/// Bytes held in blocks, used or not.
+	size_t GetCapacity() const;
+
+protected:
+	struct Block{
+		uint8_t *data;
+		size_t size;
+	};
+	size_t blockSize;
+	Array<Block> blocks;
+	unsigned current; ///< Block being allocated from
+	size_t offset;    ///< First free byte in the current block
+};
+
+#endif
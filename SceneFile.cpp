@@ -0,0 +1,189 @@
+#include "SceneFile.h"
+
+static const char sceneFileMagic[4] = {'O', 'C', 'S', 'C'};
+
+bool SceneFile::Open(const char *path, uint64_t hash)
+{
+	Close();
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(Header)
+		|| (uint64_t)fileSize.QuadPart > (size_t)-1)
+	{
+		Close();
+		return false;
+	}
+	size = (size_t)fileSize.QuadPart;
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping)
+		view = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view)
+	{
+		Close();
+		return false;
+	}
+
+	const Header &h = GetHeader();
+	if (memcmp(h.magic, sceneFileMagic, sizeof(h.magic)) || h.version != Version || h.hash != hash
+		|| h.vertexSize != sizeof(Vertex))
+	{
+		Close();
+		return false;
+	}
+
+	// Check that every section is inside the file before anything is read.
+	uint64_t offset = sizeof(Header) + uint64_t(h.atomCount) * 3 * sizeof(float) + uint64_t(h.bondCount) * sizeof(BondPair)
+		+ SpeciesSize(h.atomCount);
+	meshOffset = (size_t)offset;
+	for (uint32_t i = 0; i < h.meshCount && offset <= size; i++)
+	{
+		if (offset + sizeof(MeshHeader) > size)
+		{
+			offset = size + 1;
+			break;
+		}
+		const MeshHeader &m = *(const MeshHeader*)(view + offset);
+		offset += sizeof(MeshHeader) + uint64_t(m.vertexCount) * sizeof(Vertex) + uint64_t(m.indexCount) * sizeof(uint32_t);
+	}
+	if (offset != size)
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void SceneFile::Close()
+{
+	if (view)
+		UnmapViewOfFile(view);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+	view = NULL;
+	size = 0;
+}
+
+void SceneFile::ReadAtoms(AtomArrays &atoms) const
+{
+	unsigned n = GetHeader().atomCount;
+	atoms.Resize(n);
+	if (n == 0)
+		return;
+	const float *x = (const float*)(view + sizeof(Header));
+	memcpy(&atoms.x[0], x, n * sizeof(float));
+	memcpy(&atoms.y[0], x + n, n * sizeof(float));
+	memcpy(&atoms.z[0], x + 2 * n, n * sizeof(float));
+	memcpy(&atoms.species[0], view + sizeof(Header) + n * 3 * sizeof(float) + GetHeader().bondCount * sizeof(BondPair),
+		n * sizeof(uint16_t));
+}
+
+void SceneFile::ReadBonds(Array<BondPair> &bonds) const
+{
+	const Header &h = GetHeader();
+	bonds.Resize(h.bondCount);
+	if (h.bondCount)
+		memcpy(&bonds[0], view + sizeof(Header) + h.atomCount * 3 * sizeof(float), h.bondCount * sizeof(BondPair));
+}
+
+void SceneFile::ReadMeshes(Container &atomNode, Container &bondNode, ShaderFill *fill) const
+{
+	const uint8_t *p = view + meshOffset;
+	for (uint32_t i = 0; i < GetHeader().meshCount; i++)
+	{
+		const MeshHeader &m = *(const MeshHeader*)p;
+		p += sizeof(MeshHeader);
+		Ptr<Model> model = *new Model(PrimitiveType(m.type));
+		model->Vertices.Append((const Vertex*)p, m.vertexCount);
+		p += m.vertexCount * sizeof(Vertex);
+		model->Indices.Append((const uint32_t*)p, m.indexCount);
+		p += m.indexCount * sizeof(uint32_t);
+		model->Fill = fill;
+		(m.node ? bondNode : atomNode).Add(model);
+	}
+}
+
+uint32_t SceneFile::WriteMeshes(FILE *f, const Container *node, uint32_t index)
+{
+	uint32_t count = 0;
+	for (unsigned i = 0; node && i < node->Nodes.GetSize(); i++)
+	{
+		if (node->Nodes[i]->GetType() != Node::Node_Model)
+			continue;
+		const Model *model = (const Model*)node->Nodes[i].GetPtr();
+		count++;
+		if (!f)
+			continue;
+		MeshHeader m;
+		m.node = index;
+		m.type = model->GetPrimType();
+		m.vertexCount = (uint32_t)model->Vertices.GetSize();
+		m.indexCount = (uint32_t)model->Indices.GetSize();
+		fwrite(&m, sizeof(m), 1, f);
+		if (m.vertexCount)
+			fwrite(&model->Vertices[0], sizeof(Vertex), m.vertexCount, f);
+		if (m.indexCount)
+			fwrite(&model->Indices[0], sizeof(uint32_t), m.indexCount, f);
+	}
+	return count;
+}
+
+bool SceneFile::Write(const char *path, uint64_t hash, const AtomArrays &atoms, const Array<BondPair> &bonds,
+	const Container *atomNode, const Container *bondNode)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return false;
+
+	Header h;
+	memcpy(h.magic, sceneFileMagic, sizeof(h.magic));
+	h.version = Version;
+	h.hash = hash;
+	h.vertexSize = sizeof(Vertex);
+	h.atomCount = atoms.GetSize();
+	h.bondCount = (uint32_t)bonds.GetSize();
+	h.meshCount = WriteMeshes(NULL, atomNode, 0) + WriteMeshes(NULL, bondNode, 1);
+	fwrite(&h, sizeof(h), 1, f);
+	if (h.atomCount)
+	{
+		fwrite(&atoms.x[0], sizeof(float), h.atomCount, f);
+		fwrite(&atoms.y[0], sizeof(float), h.atomCount, f);
+		fwrite(&atoms.z[0], sizeof(float), h.atomCount, f);
+	}
+	if (h.bondCount)
+		fwrite(&bonds[0], sizeof(BondPair), h.bondCount, f);
+	if (h.atomCount)
+	{
+		fwrite(&atoms.species[0], sizeof(uint16_t), h.atomCount, f);
+		if (h.atomCount % 2)
+		{
+			uint16_t pad = 0;
+			fwrite(&pad, sizeof(pad), 1, f);
+		}
+	}
+	WriteMeshes(f, atomNode, 0);
+	WriteMeshes(f, bondNode, 1);
+
+	// A short write leaves a file that Open() rejects by its size.
+	bool ok = !ferror(f);
+	return fclose(f) == 0 && ok;
+}
+
+bool SceneFile::GetDefaultPath(char *path, size_t size)
+{
+	DWORD length = GetModuleFileNameA(NULL, path, (DWORD)size);
+	if (length == 0 || length >= size)
+		return false;
+	char *slash = strrchr(path, '\\');
+	char *name = slash ? slash + 1 : path;
+	static const char fileName[] = "OculusTest.scene";
+	if (size_t(name - path) + sizeof(fileName) > size)
+		return false;
+	memcpy(name, fileName, sizeof(fileName));
+	return true;
+}
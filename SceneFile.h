@@ -0,0 +1,84 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include "RenderTiny_D3D11_Device.h"
+#include "CrystalLattice.h"
+#include <stdio.h>
+
+/// 64 bit FNV-1a hash of the parameters a scene was generated from.
+class SceneHash{
+public:
+	SceneHash() : value(14695981039346656037ULL){}
+
+	void Add(const void *data, size_t size){
+		const uint8_t *p = (const uint8_t*)data;
+		for (size_t i = 0; i < size; i++)
+			value = (value ^ p[i]) * 1099511628211ULL;
+	}
+	template<class T> void Add(const T &v){ Add(&v, sizeof(v)); }
+
+	uint64_t Get() const { return value; }
+
+protected:
+	uint64_t value;
+};
+
+/// A generated crystal saved in a binary file: the atom positions, the bonds,
+/// the atom species and any baked meshes, stored exactly as they are laid out in memory. A
+/// header with a format version and the hash of the generation parameters
+/// tells whether the file can be used. Open() maps the file into memory, so
+/// reading it is a bulk copy of each section without any parsing.
+class SceneFile{
+public:
+	/// Increment on any change to the layout of the file.
+	static const uint32_t Version = 2;
+
+	SceneFile() : file(INVALID_HANDLE_VALUE), mapping(NULL), view(NULL), size(0){}
+	~SceneFile(){ Close(); }
+
+	/// Maps the file at path. Returns false if it is missing, truncated, of
+	/// another version or made from parameters with another hash.
+	bool Open(const char *path, uint64_t hash);
+	void Close();
+
+	void ReadAtoms(AtomArrays &atoms) const;
+	void ReadBonds(Array<BondPair> &bonds) const;
+	/// Adds the baked meshes to the node they were saved from, drawn with fill.
+	void ReadMeshes(Container &atomNode, Container &bondNode, ShaderFill *fill) const;
+
+	/// Saves atoms and bonds, and the Models in atomNode and bondNode if they
+	/// are given. Returns false if the file could not be written.
+	static bool Write(const char *path, uint64_t hash, const AtomArrays &atoms, const Array<BondPair> &bonds,
+		const Container *atomNode = NULL, const Container *bondNode = NULL);
+
+	/// Returns the path of the scene file next to the executable.
+	static bool GetDefaultPath(char *path, size_t size);
+
+protected:
+	struct Header{
+		char magic[4];
+		uint32_t version;
+		uint64_t hash;
+		uint32_t vertexSize; ///< sizeof(Vertex), which the meshes depend on
+		uint32_t atomCount, bondCount, meshCount;
+	};
+	struct MeshHeader{
+		uint32_t node; ///< 0 for atoms, 1 for bonds
+		uint32_t type; ///< PrimitiveType
+		uint32_t vertexCount, indexCount;
+	};
+
+	const Header &GetHeader() const { return *(const Header*)view; }
+	/// Returns the size of the species section, padded so that the meshes
+	/// after it stay aligned.
+	static uint64_t SpeciesSize(uint32_t atomCount){ return uint64_t((atomCount + 1) & ~1u) * sizeof(uint16_t); }
+	/// Writes the Models among the children of node, or only counts them if f is NULL.
+	static uint32_t WriteMeshes(FILE *f, const Container *node, uint32_t index);
+
+	HANDLE file, mapping;
+	const uint8_t *view;
+	size_t size;
+	size_t meshOffset; ///< Where the first MeshHeader starts
+};
+
+#endif
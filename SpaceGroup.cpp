@@ -0,0 +1,216 @@
+#include "SpaceGroup.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+
+bool ParseSymOp(const char *text, SymOp &op)
+{
+	memset(&op, 0, sizeof(op));
+	const char *p = text;
+	for (int row = 0; row < 3; row++)
+	{
+		// A sum of signed terms, each an axis or a number or fraction.
+		bool empty = true;
+		for (;;)
+		{
+			while (*p == ' ')
+				p++;
+			if (*p == ',' || *p == '\0')
+				break;
+			float sign = 1;
+			if (*p == '+' || *p == '-')
+			{
+				sign = *p == '-' ? -1.f : 1.f;
+				p++;
+				while (*p == ' ')
+					p++;
+			}
+			char c = (char)tolower((unsigned char)*p);
+			if ('x' <= c && c <= 'z')
+			{
+				op.rot[row][c - 'x'] += sign;
+				p++;
+			}
+			else if (isdigit((unsigned char)*p) || *p == '.')
+			{
+				char *end;
+				float v = (float)strtod(p, &end);
+				p = end;
+				if (*p == '/')
+				{
+					float d = (float)strtod(p + 1, &end);
+					if (end == p + 1 || d == 0)
+						return false;
+					p = end;
+					v /= d;
+				}
+				op.trans[row] += sign * v;
+			}
+			else
+				return false;
+			empty = false;
+		}
+		if (empty || (row < 2 && *p++ != ','))
+			return false;
+	}
+	return *p == '\0';
+}
+
+void MakeCubicSpaceGroup(LatticeCentering centering, float inversionShift, Array<SymOp> &ops)
+{
+	static const float centerings[][3] = {
+		{0, 0, 0}, {0.5f, 0.5f, 0.5f}, {0, 0.5f, 0.5f}, {0.5f, 0, 0.5f}, {0.5f, 0.5f, 0},
+	};
+	static const int permutations[6][3] = {
+		{0, 1, 2}, {1, 2, 0}, {2, 0, 1}, {0, 2, 1}, {2, 1, 0}, {1, 0, 2},
+	};
+	// The translations of each LatticeCentering, as indices into centerings.
+	static const int translations[3][4] = {{0}, {0, 1}, {0, 2, 3, 4}};
+	static const int translationCount[3] = {1, 2, 4};
+
+	// m-3m is every signed permutation of the axes; those with an even number
+	// of sign changes make up -43m.
+	for (int c = 0; c < translationCount[centering]; c++)
+	{
+		const float *t = centerings[translations[centering][c]];
+		for (int p = 0; p < 6; p++)
+		for (int signs = 0; signs < 8; signs++)
+		{
+			SymOp op;
+			memset(&op, 0, sizeof(op));
+			int flips = (signs & 1) + (signs >> 1 & 1) + (signs >> 2 & 1);
+			for (int r = 0; r < 3; r++)
+			{
+				op.rot[r][permutations[p][r]] = signs >> r & 1 ? -1.f : 1.f;
+				op.trans[r] = t[r] + (flips % 2 ? inversionShift : 0);
+			}
+			ops.PushBack(op);
+		}
+	}
+}
+
+// Open addressing table from a cell of the hash grid to the first distinct
+// atom in it.
+struct CellTable
+{
+	struct Slot
+	{
+		uint64_t key;
+		int head; ///< -1 if the slot is free
+	};
+	Array<Slot> slots;
+	unsigned mask;
+
+	explicit CellTable(unsigned count)
+	{
+		unsigned size = 16;
+		while (size < 2 * count)
+			size *= 2;
+		slots.Resize(size);
+		for (unsigned i = 0; i < size; i++)
+			slots[i].head = -1;
+		mask = size - 1;
+	}
+
+	/// Returns the slot of key, which is free if key has no atoms yet.
+	Slot &Find(uint64_t key)
+	{
+		unsigned i = unsigned((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+		while (slots[i].head >= 0 && slots[i].key != key)
+			i = (i + 1) & mask;
+		return slots[i];
+	}
+};
+
+void ExpandAsymmetricUnit(const SymOp *ops, int opCount, const BasisAtom *asym, int asymCount,
+	float tolerance, Array<BasisAtom> &basis)
+{
+	basis.Clear();
+	const unsigned n = unsigned(opCount) * asymCount;
+	if (n == 0)
+		return;
+
+	// Every operation maps the whole unit, held as separate coordinate
+	// arrays, with the same straight-line arithmetic, which the compiler
+	// turns into vector instructions.
+	Array<float> ax, ay, az, px, py, pz;
+	ax.Resize(asymCount); ay.Resize(asymCount); az.Resize(asymCount);
+	px.Resize(n); py.Resize(n); pz.Resize(n);
+	for (int i = 0; i < asymCount; i++)
+	{
+		ax[i] = asym[i].x;
+		ay[i] = asym[i].y;
+		az[i] = asym[i].z;
+	}
+	for (int o = 0; o < opCount; o++)
+	{
+		const SymOp &op = ops[o];
+		const float *x = &ax[0], *y = &ay[0], *z = &az[0];
+		float *ox = &px[o * asymCount], *oy = &py[o * asymCount], *oz = &pz[o * asymCount];
+		for (int i = 0; i < asymCount; i++)
+		{
+			float fx = op.rot[0][0] * x[i] + op.rot[0][1] * y[i] + op.rot[0][2] * z[i] + op.trans[0];
+			float fy = op.rot[1][0] * x[i] + op.rot[1][1] * y[i] + op.rot[1][2] * z[i] + op.trans[1];
+			float fz = op.rot[2][0] * x[i] + op.rot[2][1] * y[i] + op.rot[2][2] * z[i] + op.trans[2];
+			ox[i] = fx - floor(fx);
+			oy[i] = fy - floor(fy);
+			oz[i] = fz - floor(fz);
+		}
+	}
+
+	// A periodic grid of cells at least twice tolerance wide, so a duplicate
+	// of an atom is in its cell or the one next to it on the nearer side
+	// along each axis, wrapping at faces: 8 cells to look in.
+	int g = tolerance > 0 && tolerance < 0.5f ? int(0.5f / tolerance) : 1;
+	g = g < (1 << 20) ? g : 1 << 20;
+	auto keyOf = [g](int cx, int cy, int cz){
+		cx = (cx + g) % g;
+		cy = (cy + g) % g;
+		cz = (cz + g) % g;
+		return uint64_t(cx) | uint64_t(cy) << 21 | uint64_t(cz) << 42;
+	};
+	const float tolerance2 = tolerance * tolerance;
+	CellTable table(n);
+	Array<int> next; ///< The next distinct atom in the same cell as each one
+
+	for (int a = 0; a < asymCount; a++)
+	for (int o = 0; o < opCount; o++)
+	{
+		unsigned k = o * asymCount + a;
+		int cell[3], side[3];
+		const float p[3] = {px[k], py[k], pz[k]};
+		for (int i = 0; i < 3; i++)
+		{
+			float f = p[i] * g;
+			cell[i] = int(f);
+			cell[i] = cell[i] < 0 ? 0 : g <= cell[i] ? g - 1 : cell[i];
+			side[i] = f - cell[i] < 0.5f ? -1 : 1;
+		}
+		bool found = false;
+		for (int c = 0; c < 8 && !found; c++)
+		{
+			uint64_t key = keyOf(cell[0] + (c & 1 ? side[0] : 0), cell[1] + (c & 2 ? side[1] : 0),
+				cell[2] + (c & 4 ? side[2] : 0));
+			for (int j = table.Find(key).head; j >= 0 && !found; j = next[j])
+			{
+				// The nearest image across cell faces.
+				float ex = p[0] - basis[j].x, ey = p[1] - basis[j].y, ez = p[2] - basis[j].z;
+				ex -= floor(ex + 0.5f);
+				ey -= floor(ey + 0.5f);
+				ez -= floor(ez + 0.5f);
+				found = ex * ex + ey * ey + ez * ez < tolerance2;
+			}
+		}
+		if (found)
+			continue;
+
+		BasisAtom b = {p[0], p[1], p[2], asym[a].species};
+		uint64_t key = keyOf(cell[0], cell[1], cell[2]);
+		CellTable::Slot &slot = table.Find(key);
+		slot.key = key;
+		next.PushBack(slot.head);
+		slot.head = (int)basis.GetSize();
+		basis.PushBack(b);
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef SPACEGROUP_H
+#define SPACEGROUP_H
+
+#include "CrystalLattice.h"
+
+/// A symmetry operation of a space group in fractional coordinates, taking p
+/// to rot * p + trans.
+struct SymOp
+{
+	float rot[3][3];
+	float trans[3];
+};
+
+/// Parses an operation written as in the International Tables and CIF files,
+/// e.g. "-y+1/2,x,z+1/4". Returns false if text is not of that form.
+bool ParseSymOp(const char *text, SymOp &op);
+
+/// Lattice centering of a space group, which adds pure translations.
+enum LatticeCentering
+{
+	Centering_P, ///< Primitive
+	Centering_I, ///< Body centered
+	Centering_F, ///< Face centered
+};
+
+/// Appends the 48 operations of a cubic space group with point group m-3m
+/// for each centering translation. The 24 operations outside -43m, such as
+/// the inversion, are translated by inversionShift along each axis, which is
+/// 0 for Pm-3m, Im-3m and Fm-3m and 1/4 for Fd-3m with origin choice 1.
+void MakeCubicSpaceGroup(LatticeCentering centering, float inversionShift, Array<SymOp> &ops);
+
+/// Applies every operation to every atom of an asymmetric unit and replaces
+/// basis with the distinct results wrapped into the unit cell, in the order
+/// they are first found for each atom of the unit. Positions closer than
+/// tolerance, in fractional coordinates and across cell faces, are taken as
+/// one atom; they are found with a hash grid of cells twice that size, so
+/// the expansion is linear in the number of positions.
+void ExpandAsymmetricUnit(const SymOp *ops, int opCount, const BasisAtom *asym, int asymCount,
+	float tolerance, Array<BasisAtom> &basis);
+
+#endif
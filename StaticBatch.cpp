@@ -0,0 +1,87 @@
+#include "StaticBatch.h"
+#include <algorithm>
+
+void StaticBatch::Add(const Model *mesh, ShaderFill *fill, const Matrix4f &xform, const Color &c)
+{
+	Item item;
+	item.fill = fill;
+	item.cx = item.cy = item.cz = 0;
+	if (chunkSize > 0)
+	{
+		item.cx = int(floor(xform.M[0][3] / chunkSize));
+		item.cy = int(floor(xform.M[1][3] / chunkSize));
+		item.cz = int(floor(xform.M[2][3] / chunkSize));
+	}
+	item.mesh = mesh;
+	item.xform = xform;
+	item.c = c;
+	items.PushBack(item);
+}
+
+int StaticBatch::Build(Container &world)
+{
+	if (items.GetSize() == 0)
+		return 0;
+
+	// Sort so that items sharing a fill and a chunk are adjacent.
+	std::sort(&items[0], &items[0] + items.GetSize(), [](const Item &a, const Item &b){
+		if (a.fill != b.fill)
+			return a.fill < b.fill;
+		if (a.cx != b.cx)
+			return a.cx < b.cx;
+		if (a.cy != b.cy)
+			return a.cy < b.cy;
+		return a.cz < b.cz;
+	});
+
+	auto sameBatch = [](const Item &a, const Item &b){
+		return a.fill == b.fill && a.cx == b.cx && a.cy == b.cy && a.cz == b.cz
+			&& a.mesh->GetPrimType() == b.mesh->GetPrimType();
+	};
+
+	int models = 0;
+	Ptr<Model> batch;
+	for (unsigned i = 0; i < items.GetSize(); i++)
+	{
+		const Item &item = items[i];
+		const Model *mesh = item.mesh;
+
+		// Start a new Model at chunk boundaries.
+		if (!batch || !sameBatch(items[i - 1], item))
+		{
+			if (batch)
+				world.Add(batch);
+			batch = *new Model(mesh->GetPrimType());
+			batch->Fill = item.fill;
+			models++;
+
+			// Reserve for the whole chunk; it may need 32-bit indices.
+			size_t vertices = 0, indices = 0;
+			for (unsigned j = i; j < items.GetSize() && sameBatch(item, items[j]); j++)
+			{
+				vertices += items[j].mesh->Vertices.GetSize();
+				indices += items[j].mesh->Indices.GetSize();
+			}
+			batch->Vertices.Reserve(vertices);
+			batch->Indices.Reserve(indices);
+		}
+
+		// Normals go through the inverse transpose, so non-uniform scaling is fine.
+		Matrix4f normalXform = item.xform.Inverted().Transposed();
+		uint32_t startIndex = batch->GetNextVertexIndex();
+		for (unsigned v = 0; v < mesh->Vertices.GetSize(); v++)
+		{
+			Vertex vert = mesh->Vertices[v];
+			vert.Pos = item.xform.Transform(vert.Pos);
+			vert.Norm = normalXform.Transform(vert.Norm).Normalized();
+			vert.C = item.c;
+			batch->Vertices.PushBack(vert);
+		}
+		for (unsigned n = 0; n < mesh->Indices.GetSize(); n++)
+			batch->Indices.PushBack(mesh->Indices[n] + startIndex);
+	}
+	world.Add(batch);
+
+	items.Clear();
+	return models;
+}
@@ -0,0 +1,38 @@
+#ifndef STATICBATCH_H
+#define STATICBATCH_H
+
+#include "RenderTiny_D3D11_Device.h"
+
+/// Merges transformed copies of small meshes into a few large Models, one set
+/// per ShaderFill and spatial chunk, so that static geometry costs one draw call
+/// per chunk instead of one per object.
+class StaticBatch
+{
+public:
+	/// A chunkSize of 0 puts everything in one chunk.
+	StaticBatch(float chunkSize = 4.f) : chunkSize(chunkSize){}
+
+	/// Queues a copy of mesh transformed by xform, with vertex colors replaced by c.
+	/// The copy goes to the chunk containing its transformed origin.
+	/// The mesh must stay alive until Build() is called.
+	void Add(const Model *mesh, ShaderFill *fill, const Matrix4f &xform, const Color &c);
+
+	/// Creates the merged Models, adds them to world and returns how many were made.
+	int Build(Container &world);
+
+	void Clear(){ items.Clear(); }
+
+protected:
+	struct Item{
+		ShaderFill *fill;
+		int cx, cy, cz;
+		const Model *mesh;
+		Matrix4f xform;
+		Color c;
+	};
+
+	float chunkSize;
+	Array<Item> items;
+};
+
+#endif
@@ -222,8 +222,7 @@ int Init()
                             ovrTrackingCap_Position, 0);
 
     // This creates lights and models.
-  	pRoomScene = new Scene;
-	sbuilder.PopulateRoomScene(pRoomScene, pRender);
+	sbuilder.Init(pRender);
 
     return (0);
 }
@@ -231,23 +230,326 @@ int Init()
 void SceneBuilder::ToggleStructure()
 {
 	structure = CrystalStructure((structure + 1) % Num_CrystalStructure);
-	PopulateRoomScene(pRoomScene, pRender);
+	cells = 0;
+	RequestRebuild();
 }
 
 void SceneBuilder::ResizeAtom(double relscale)
 {
 	scale = min(1, scale * relscale);
-	PopulateRoomScene(pRoomScene, pRender);
+	// Baked spheres have the radius in their vertices.
+	if (!current->IsInstanced())
+		RequestRebuild();
+	else
+		Apply(*current);
 }
 
 void SceneBuilder::ToggleDrawAtom(){
 	drawAtom = !drawAtom;
-	PopulateRoomScene(pRoomScene, pRender);
+	Apply(*current);
 }
 
 void SceneBuilder::ToggleDrawBond(){
 	drawBond = !drawBond;
-	PopulateRoomScene(pRoomScene, pRender);
+	Apply(*current);
+}
+
+void SceneBuilder::ToggleBakeStatic(){
+	bakeStatic = !bakeStatic;
+	RequestRebuild();
+}
+
+void SceneBuilder::ToggleStream(){
+	stream = !stream;
+	RequestRebuild();
+}
+
+void SceneBuilder::ToggleSupercell(){
+	supercell = !supercell;
+	RequestRebuild();
+}
+
+void SceneBuilder::TogglePolycrystal(){
+	polycrystal = !polycrystal;
+	RequestRebuild();
+}
+
+void SceneBuilder::ResizeExtent(int d){
+	cells = max(1, GetCells() + d);
+	if (stream)
+		return;
+	// Shrinking, or growing back, an instanced crystal shows at once, as
+	// does any extent of supercell blocks. The request then either grows
+	// the missing shells or, if the crystal is baked or another change is
+	// pending, rebuilds it.
+	if ((current->IsInstanced() || current->blockCells) && !current->stream)
+		Apply(*current);
+	RequestRebuild();
+}
+
+void SceneBuilder::RequestRebuild()
+{
+	// A scene that serves the new parameters is shown at once; the request
+	// then only grows it if needed and stops any build in progress.
+	SceneDetail detail = Govern(*this);
+	CrystalScene *found = current->Serves(*this, detail) ? current : TakeCached(*this, detail);
+	CrystalScene *stale = NULL;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending = *this;
+		requested = true;
+		if (found)
+		{
+			stale = ready;
+			ready = NULL;
+			// latestCells of latest already counts the shells waiting for
+			// Update(); another scene may have some waiting too.
+			if (found != latest)
+			{
+				latestCells = found->generatedCells;
+				for (unsigned i = 0; i < readyShells.GetSize(); i++)
+					if (readyShells[i]->serial == found->serial)
+						latestCells = max(latestCells, readyShells[i]->shell + 1);
+			}
+			latest = found;
+			latestParams = found->params;
+		}
+	}
+	wake.notify_one();
+
+	if (stale)
+		Cache(stale);
+	if (found && found != current)
+	{
+		Cache(current);
+		current = found;
+	}
+	if (found)
+		Apply(*current, true);
+}
+
+bool SceneBuilder::Superseded() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return requested || quit;
+}
+
+// Whether a scene built with params a can be grown to b by adding shells.
+static bool CanGrow(const SceneParams &a, const SceneParams &b)
+{
+	return a.structure == b.structure && !a.bakeStatic && !b.bakeStatic && !a.stream && !b.stream
+		&& !a.supercell && !b.supercell && !a.IsPolycrystal() && !b.IsPolycrystal();
+}
+
+void SceneBuilder::BuildThread()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		wake.wait(lock, [&]{ return requested || quit; });
+		if (quit)
+			break;
+		SceneParams params = pending;
+		requested = false;
+
+		// Shells are grown with the detail the scene was built with, so a
+		// scene grown past its budget is built again instead.
+		SceneDetail detail = Govern(params);
+		if (latest && CanGrow(latestParams, params) && latest->detail == detail)
+		{
+			// Each shell costs as much as the surface of the crystal, so
+			// hand them over one by one.
+			CrystalScene *target = growing = latest;
+			for (int k = latestCells; k < params.GetCells() && !requested && !quit; k++)
+			{
+				lock.unlock();
+				CrystalShell *shell = new CrystalShell;
+				BuildShell(params, k, *target, *shell);
+				lock.lock();
+				readyShells.PushBack(shell);
+				if (latest == target)
+					latestCells = k + 1;
+			}
+			growing = NULL;
+			scratch.Trim(scratchBudget);
+			continue;
+		}
+		if (latest && latest->Serves(params, detail))
+			continue;
+		lock.unlock();
+
+		CrystalScene *built = new CrystalScene;
+		bool finished = PopulateRoomScene(params, *built);
+		// The largest build would otherwise hold its temporary storage for good.
+		scratch.Trim(scratchBudget);
+
+		// An unadopted scene has never been rendered and owns no GPU
+		// resources, so it can be freed on this thread.
+		lock.lock();
+		CrystalScene *stale = built;
+		if (finished && !requested && !quit)
+		{
+			stale = ready;
+			ready = built;
+			latest = built;
+			latestParams = params;
+			latestCells = built->generatedCells;
+		}
+		lock.unlock();
+		delete stale;
+		lock.lock();
+	}
+}
+
+void SceneBuilder::Cache(CrystalScene *cs)
+{
+	if (cs->stream)
+	{
+		delete cs;
+		return;
+	}
+	cache.PushBack(cs);
+
+	// The build thread may be allocating from a scene it grows, so that one
+	// is neither measured nor evicted. Only latest is ever grown, and it is
+	// never in the cache, so this cannot change to another cached scene.
+	CrystalScene *pinned;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pinned = growing;
+	}
+
+	// Evict the least recently shown scenes until the rest fit the budget.
+	size_t total = 0;
+	for (unsigned i = 0; i < cache.GetSize(); i++)
+		if (cache[i] != pinned)
+			total += cache[i]->GetMemoryUsage();
+	for (unsigned i = 0; i < cache.GetSize() && total > cacheBudget; )
+	{
+		CrystalScene *victim = cache[i];
+		if (victim == pinned)
+		{
+			i++;
+			continue;
+		}
+		total -= victim->GetMemoryUsage();
+		cache.RemoveAt(i);
+		delete victim;
+	}
+}
+
+CrystalScene *SceneBuilder::TakeCached(const SceneParams &params, const SceneDetail &detail)
+{
+	for (unsigned i = cache.GetSize(); i-- > 0; )
+	{
+		CrystalScene *cs = cache[i];
+		if (cs->Serves(params, detail))
+		{
+			cache.RemoveAt(i);
+			return cs;
+		}
+	}
+	return NULL;
+}
+
+CrystalScene *SceneBuilder::FindScene(unsigned serial) const
+{
+	if (current->serial == serial)
+		return current;
+	for (unsigned i = 0; i < cache.GetSize(); i++)
+		if (cache[i]->serial == serial)
+			return cache[i];
+	return NULL;
+}
+
+Scene* SceneBuilder::Update(const Vector3f &viewPos, const Vector3f &viewDir, const ViewFrustum *eyes)
+{
+	this->viewPos = viewPos;
+	this->viewDir = viewDir;
+	this->eyes[0] = eyes[0];
+	this->eyes[1] = eyes[1];
+	CrystalScene *built;
+	Array<CrystalShell*> shells;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		built = ready;
+		ready = NULL;
+		shells = readyShells;
+		readyShells.Clear();
+	}
+	if (built)
+	{
+		Cache(current);
+		current = built;
+		// Catch up with radius and visibility changes made during the build.
+		Apply(*current);
+	}
+	if (shells.GetSize())
+	{
+		// Shells of a scene that has been replaced meanwhile go to the
+		// cached scene, or nowhere if it was evicted.
+		for (unsigned i = 0; i < shells.GetSize(); i++)
+		{
+			CrystalShell *shell = shells[i];
+			// A shell the scene already has was built again by a grow that
+			// started before it was adopted, and is dropped.
+			CrystalScene *cs = FindScene(shell->serial);
+			if (cs && shell->shell >= cs->generatedCells)
+			{
+				for (unsigned j = 0; j < shell->atomNode->Nodes.GetSize(); j++)
+					cs->atomNode->Add(shell->atomNode->Nodes[j]);
+				for (unsigned j = 0; j < shell->bondNode->Nodes.GetSize(); j++)
+					cs->bondNode->Add(shell->bondNode->Nodes[j]);
+				for (unsigned j = 0; j < shell->extentChunks.GetSize(); j++)
+					cs->extentChunks.PushBack(shell->extentChunks[j]);
+				cs->generatedCells = shell->shell + 1;
+			}
+			delete shell;
+		}
+		Apply(*current, true);
+	}
+	if (current->stream && current->stream->Update(viewPos))
+		Apply(*current, true);
+	if (current->blockCells)
+		CullBlocks(*current);
+	return &current->scene;
+}
+
+void SceneBuilder::Release()
+{
+	if (thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_one();
+		thread.join();
+	}
+	for (unsigned i = 0; i < readyShells.GetSize(); i++)
+		delete readyShells[i];
+	readyShells.Clear();
+	for (unsigned i = 0; i < cache.GetSize(); i++)
+		delete cache[i];
+	cache.Clear();
+	delete ready;
+	delete current;
+	ready = current = latest = NULL;
+	atomFill.Clear();
+	bondFill.Clear();
+	bakedFill.Clear();
+	blockFill.Clear();
+	atomLevels.Clear();
+	bondLevels.Clear();
+	meshes.Clear();
+}
+
+// Returns the tangent of a side of an eye's field of view, widened by the
+// most the head turns between two frames.
+static float WidenFov(float tangent)
+{
+	static const float margin = 5.f * 3.14159265f / 180;
+	return tan(atan(tangent) + margin);
 }
 
 //-------------------------------------------------------------------------------------
@@ -271,6 +573,23 @@ void ProcessAndRender()
 //	HeadPos.y = ovrHmd_GetFloat(HMD, OVR_KEY_EYE_HEIGHT, HeadPos.y);
 	bool freezeEyeRender = Util_RespondToControls(BodyYaw, HeadPos, eyeRenderPose[1].Orientation);
 
+	// Pick up a scene finished by the build thread between frames, and
+	// streamed chunks around the new head position. Edits aim where the
+	// right eye looks, and blocks are culled to what either eye saw in the
+	// last frame, widened by as far as the head may turn in one.
+	Vector3f viewDir = (Matrix4f::RotationY(BodyYaw) * Matrix4f(eyeRenderPose[1].Orientation)).Transform(Vector3f(0,0,-1));
+	ViewFrustum eyes[ovrEye_Count];
+	for (int eye = 0; eye < ovrEye_Count; eye++)
+	{
+		Matrix4f orientation = Matrix4f::RotationY(BodyYaw) * Matrix4f(eyeRenderPose[eye].Orientation);
+		Vector3f eyePos = HeadPos + Matrix4f::RotationY(BodyYaw).Transform(eyeRenderPose[eye].Position)
+			- orientation.Transform(EyeRenderDesc[eye].ViewAdjust);
+		const ovrFovPort &fov = EyeRenderDesc[eye].Fov;
+		eyes[eye].Set(eyePos, orientation, WidenFov(fov.UpTan), WidenFov(fov.DownTan),
+			WidenFov(fov.LeftTan), WidenFov(fov.RightTan));
+	}
+	pRoomScene = sbuilder.Update(HeadPos, viewDir, eyes);
+
      pRender->BeginScene();
     
 	// Render the two undistorted eye views into their render buffers.
@@ -379,8 +698,9 @@ void Release(void)
     #endif
 
     ovrHmd_Destroy(HMD);
+    sbuilder.Release();
+    pRoomScene = 0;
     Util_ReleaseWindowAndGraphics(pRender);
-    if (pRoomScene) delete pRoomScene;
 
 
     // No OVR functions involving memory are allowed after this.
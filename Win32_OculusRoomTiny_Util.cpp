@@ -88,6 +88,17 @@ void OnKey(unsigned vk, bool down)
 	case 'H':       if(!down) sbuilder.ResizeAtom(1. / 1.1); /* Reciprocal */     break;
 	case 'V':       if(!down) sbuilder.ToggleDrawAtom();                          break;
 	case 'B':       if(!down) sbuilder.ToggleDrawBond();                          break;
+	case 'G':       if(!down) sbuilder.ToggleBakeStatic();                        break;
+	case 'U':       if(!down) sbuilder.ToggleStream();                            break;
+	case 'C':       if(!down) sbuilder.ToggleSupercell();                         break;
+	case 'P':       if(!down) sbuilder.TogglePolycrystal();                       break;
+	case VK_OEM_PLUS: if(!down) sbuilder.ResizeExtent(1);                         break;
+	case VK_OEM_MINUS:if(!down) sbuilder.ResizeExtent(-1);                        break;
+	case 'J':       if(!down) sbuilder.EditAtom(SceneBuilder::Edit_Remove);      break;
+	case 'K':       if(!down) sbuilder.EditAtom(SceneBuilder::Edit_Substitute);  break;
+	case 'M':       if(!down) sbuilder.EditAtom(SceneBuilder::Edit_Push);        break;
+	case 'N':       if(!down) ShiftDown ? sbuilder.Redo() : sbuilder.Undo();      break;
+	case 'L':       if(!down) sbuilder.ScatterDefects(1000);                     break;
 
     case VK_SHIFT:  ShiftDown = down;                                             break;
     case VK_CONTROL:ControlDown = down;                                           break;
@@ -0,0 +1,101 @@
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(int threads) : body(NULL), jobCount(0), jobPieces(0), donePieces(0), busy(0),
+	checkedIn(0), generation(0), quit(false), nextPiece(0)
+{
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+	for (int i = 1; i < threads; i++)
+		workers.push_back(std::thread(&WorkerPool::WorkerMain, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+WorkerPool &WorkerPool::Shared()
+{
+	static WorkerPool pool;
+	return pool;
+}
+
+int WorkerPool::RunPieces()
+{
+	int ran = 0;
+	for (int k; (k = nextPiece++) < jobPieces; ran++)
+	{
+		int begin = int((long long)jobCount * k / jobPieces);
+		int end = int((long long)jobCount * (k + 1) / jobPieces);
+		(*body)(begin, end);
+	}
+	return ran;
+}
+
+void WorkerPool::WorkerMain()
+{
+	unsigned seen = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		wake.wait(lock, [&]{ return quit || generation != seen; });
+		if (quit)
+			return;
+		seen = generation;
+
+		// The caller waits for every worker to check in, so none can still
+		// be reading this job when the next one is set up. While busy is
+		// non-zero the caller keeps the job alive.
+		checkedIn++;
+		busy++;
+		lock.unlock();
+		int ran = RunPieces();
+		lock.lock();
+		donePieces += ran;
+		busy--;
+		finished.notify_all();
+	}
+}
+
+void WorkerPool::ParallelFor(int count, const std::function<void(int begin, int end)> &f)
+{
+	if (count <= 0)
+		return;
+
+	std::lock_guard<std::mutex> call(callMutex);
+
+	// A few pieces per thread evens out pieces of unequal cost.
+	int pieces = GetThreadCount() * 4 < count ? GetThreadCount() * 4 : count;
+	if (workers.empty() || pieces == 1)
+	{
+		f(0, count);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		body = &f;
+		jobCount = count;
+		jobPieces = pieces;
+		donePieces = 0;
+		checkedIn = 0;
+		nextPiece = 0;
+		generation++;
+	}
+	wake.notify_all();
+
+	int ran = RunPieces();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	donePieces += ran;
+	finished.wait(lock, [&]{
+		return donePieces == jobPieces && busy == 0 && checkedIn == (int)workers.size();
+	});
+	body = NULL;
+}
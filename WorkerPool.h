@@ -0,0 +1,47 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+/// A fixed set of worker threads for data-parallel loops. The calling thread
+/// takes part in the work too, and calls from different threads are serialized.
+class WorkerPool
+{
+public:
+	/// Starts threads - 1 workers; 0 means one thread per hardware thread.
+	explicit WorkerPool(int threads = 0);
+	~WorkerPool();
+
+	int GetThreadCount() const { return (int)workers.size() + 1; }
+
+	/// Calls body(begin, end) on contiguous pieces covering [0, count) and returns
+	/// when all of them are done. The pieces run in any order on any thread, so
+	/// bodies should write only to their own range of preallocated output.
+	/// Must not be called from inside a body.
+	void ParallelFor(int count, const std::function<void(int begin, int end)> &body);
+
+	/// The pool shared by scene generation.
+	static WorkerPool &Shared();
+
+protected:
+	void WorkerMain();
+	int RunPieces();
+
+	std::vector<std::thread> workers;
+	std::mutex callMutex;      ///< Serializes ParallelFor() callers
+	std::mutex mutex;          ///< Guards everything below except nextPiece
+	std::condition_variable wake, finished;
+	const std::function<void(int, int)> *body;
+	int jobCount, jobPieces, donePieces, busy;
+	int checkedIn;             ///< Workers that have seen this generation
+	unsigned generation;
+	bool quit;
+	std::atomic<int> nextPiece;
+};
+
+#endif